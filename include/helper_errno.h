@@ -6,6 +6,8 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdarg>
+#include <stdexcept>
+#include <string>
 
 #ifndef HENSURE
 #define HENSURE(x) if(!(x)) \
@@ -23,6 +25,29 @@
     } while(0)
 #endif
 
+/**
+ * If `x` is false, then throw a `helper_rdma::Error` holding the errno value.
+ */
+#ifndef HTHROW_ERRNO
+#define HTHROW_ERRNO(x) do { if(!(x)) \
+    { helper_rdma::throw_errno(#x, errno, __FILE__, __LINE__); } \
+    } while(0)
+#endif
+
+/**
+ * Same as `HTHROW_ERRNO` for functions returning the error code instead of setting errno
+ * (`ibv_post_send`, `ibv_modify_qp`, `ibv_query_*`...).
+ */
+#ifndef HTHROW_RET
+#define HTHROW_RET(x) do { const int ret_ = (x); if(ret_ != 0) \
+    { helper_rdma::throw_errno(#x, ret_, __FILE__, __LINE__); } \
+    } while(0)
+#endif
+
+#ifndef THROW_ERROR
+#define THROW_ERROR(...) helper_rdma::throw_error(__FILE__, __LINE__, __VA_ARGS__)
+#endif
+
 #ifndef FATAL_ERROR
 #define FATAL_ERROR(...) fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); helper_rdma::fatal_error(__VA_ARGS__)
 #endif
@@ -30,6 +55,52 @@
 namespace helper_rdma
 {
 
+/**
+ * Error thrown by the RDMA helpers instead of terminating the process.
+ * The caller can then recover, for example by reconnecting.
+ */
+class Error : public std::runtime_error
+{
+public:
+    explicit Error(const std::string& what, int code = 0)
+        : std::runtime_error(what), m_code(code)
+    {
+    }
+
+    /**
+     * @returns The errno value of the failure, or 0 if it does not come from a system call.
+     */
+    int code() const noexcept
+    {
+        return m_code;
+    }
+
+private:
+    int m_code;
+};
+
+[[noreturn]] static inline
+void throw_errno(const char* expr, int code, const char* file, int line)
+{
+    char msg[512];
+    snprintf(msg, sizeof(msg), "'%s' failed. errno=\"%s\" [%s:%d]", expr, strerror(code), file, line);
+    throw Error(msg, code);
+}
+
+[[noreturn]] static inline
+void throw_error(const char* file, int line, const char* fmt, ...)
+{
+    char msg[512];
+    const int prefix_len = snprintf(msg, sizeof(msg), "%s:%d: ", file, line);
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg + prefix_len, sizeof(msg) - prefix_len, fmt, args);
+    va_end(args);
+
+    throw Error(msg);
+}
+
 /**
  * Exit the program with the error code EXIT_FAILURE.
  * Print the `info` message and the errno error string.
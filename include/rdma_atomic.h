@@ -0,0 +1,94 @@
+#pragma once
+
+#include "rdma_base.h"
+
+/**
+ * A 64 bits counter in the memory of the peer, incremented with one-sided atomics.
+ * The peer CPU is not involved.
+ *
+ * The remote word should be 8 bytes aligned, in a region registered with IBV_ACCESS_REMOTE_ATOMIC
+ * (see `RdmaOptions::recv_access`).
+ */
+class RdmaRemoteCounter
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * @param conn The connection to the peer owning the counter.
+     * @param scratch 8 bytes in the buffers of `conn` where the atomic results are stored.
+     * @param remote_addr, rkey The counter in the peer memory.
+     */
+    RdmaRemoteCounter(RdmaBase& conn, const Buffer& scratch, uint64_t remote_addr, uint32_t rkey);
+
+    /**
+     * Atomically add `value` to the counter.
+     * Blocking.
+     * @returns The value of the counter before the addition, which makes it a sequence number generator.
+     */
+    uint64_t fetch_add(uint64_t value = 1);
+
+    /**
+     * @returns The current value of the counter.
+     * Blocking.
+     */
+    uint64_t load();
+
+private:
+    RdmaBase& m_conn;
+    Buffer m_scratch;
+    uint64_t m_remote_addr;
+    uint32_t m_rkey;
+};
+
+/**
+ * A spinlock in the memory of the peer, acquired and released with one-sided compare and swap.
+ * The peer CPU is not involved.
+ *
+ * The lock word is 0 when free, and the owner ID when taken.
+ * The remote word should be 8 bytes aligned, in a region registered with IBV_ACCESS_REMOTE_ATOMIC,
+ * and initialized to 0.
+ */
+class RdmaRemoteLock
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * @param conn The connection to the peer owning the lock.
+     * @param scratch 8 bytes in the buffers of `conn` where the atomic results are stored.
+     * @param remote_addr, rkey The lock word in the peer memory.
+     * @param owner_id Identifies this client, should be unique among the clients of the lock and not 0.
+     */
+    RdmaRemoteLock(RdmaBase& conn, const Buffer& scratch, uint64_t remote_addr, uint32_t rkey, uint64_t owner_id);
+
+    /**
+     * Try to take the lock once.
+     * Blocking until the compare and swap completes.
+     * @returns true if the lock was taken.
+     */
+    bool try_lock();
+
+    /**
+     * Take the lock, retrying with an exponential backoff to not flood the peer NIC.
+     * Blocking.
+     */
+    void lock();
+
+    /**
+     * Release the lock.
+     * Blocking.
+     * @note Throw an error if the lock is not owned by this client.
+     */
+    void unlock();
+
+private:
+    // Compare and swap on the lock word, returns the previous value
+    uint64_t cmp_swap(uint64_t compare, uint64_t swap);
+
+    RdmaBase& m_conn;
+    Buffer m_scratch;
+    uint64_t m_remote_addr;
+    uint32_t m_rkey;
+    uint64_t m_owner_id;
+};
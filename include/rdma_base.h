@@ -1,21 +1,72 @@
 #pragma once
 
 #include "helper_errno.h"
+#include "rdma_options.h"
+#include "rdma_trace.h"
 #include <rdma/rdma_cma.h>
 #include <netdb.h>
 #include <pthread.h>
 
 #include <cstdlib>
+#include <deque>
 #include <thread>
 #include <functional>
 #include <vector>
 
+namespace helper_rdma
+{
+
+/**
+ * Thrown when a work completion is polled with a status other than IBV_WC_SUCCESS.
+ * The QP is then in the error state and the connection has to be re-established with `RdmaBase::reconnect()`.
+ */
+class WcError : public Error
+{
+public:
+    explicit WcError(const ibv_wc& wc);
+
+    /**
+     * @returns The failed work completion.
+     */
+    const ibv_wc& wc() const noexcept
+    {
+        return m_wc;
+    }
+
+private:
+    ibv_wc m_wc;
+};
+
+}
+
 /**
  * Common base class for both the RDMA client and server.
  */
 class RdmaBase
 {
 public:
+    /**
+     * How operations that are not pinned to a QP are distributed when the connection has more than one QP.
+     * @see select_qp()
+     */
+    enum class Ordering
+    {
+        /**
+         * Everything goes to the first QP, all the operations are ordered.
+         */
+        Strict,
+
+        /**
+         * Operations with the same key go to the same QP, so they are ordered between them.
+         */
+        PerKey,
+
+        /**
+         * Round robin over the QPs, no ordering.
+         */
+        Relaxed
+    };
+
     /**
      * Represents a block of contiguous memory.
      * This has a pointer to a data and a size.
@@ -31,8 +82,9 @@ public:
      * How many bytes should be allocated in the pinned memory region to handle "send" operations.
      * @param recv_buf_sz Size of the receiving buffer.
      * How many bytes should be allocated in the pinned memory region to handle "receive" operations.
+     * @param options Queue sizes and QP attributes, validated against the device limits when connecting.
      */
-    RdmaBase(uint32_t send_buf_sz, uint32_t recv_buf_sz);
+    RdmaBase(uint32_t send_buf_sz, uint32_t recv_buf_sz, const RdmaOptions& options = {});
 
     /**
      * Destroys all RDMA resources.
@@ -64,6 +116,105 @@ public:
      */
     uint32_t get_recv_rkey();
 
+    /**
+     * @returns The protection domain of the connection, to register memory managed outside of it
+     * (e.g. `RdmaBufferPool`).
+     * The connection context should exist, like for `register_memory()`.
+     */
+    ibv_pd* get_protection_domain();
+
+    /**
+     * Register an additional memory region in the protection domain of the connection.
+     * The connection context should exist, so this should be called once connected,
+     * or on a server bound to the address of a device.
+     * @param access The `ibv_access_flags` of the region.
+     * @returns The region, it is deregistered by `deregister_memory()` or by the destructor.
+     * @note The operations on buffers inside this region find its lkey automatically.
+     */
+    ibv_mr* register_memory(void* addr, size_t size, int access);
+
+    /**
+     * Deregister a memory region returned by `register_memory()`.
+     */
+    void deregister_memory(ibv_mr* mr);
+
+    /**
+     * @returns true if the device supports on-demand paging on RC QPs for all the operations in `rc_ops`
+     * (`ibv_odp_transport_cap_bits`).
+     * Regions registered with IBV_ACCESS_ON_DEMAND are then not pinned, and can be as large as the address space.
+     * The connection context should exist, like for `register_memory()`.
+     */
+    bool supports_on_demand_paging(uint32_t rc_ops);
+
+    /**
+     * Allocate a type 2 memory window, to give the peer access to a part of a region for a limited time.
+     * The connection context should exist, like for `register_memory()`.
+     * @note Throw an error if the device does not support type 2 memory windows.
+     * @see post_bind_window()
+     */
+    ibv_mw* alloc_window();
+
+    /**
+     * Free a memory window from `alloc_window()`.
+     */
+    void dealloc_window(ibv_mw* mw);
+
+    /**
+     * Post a bind of a memory window on `buf`, without registering memory.
+     * The work requests posted after it on the same QP see the window bound,
+     * so the rkey can be sent to the peer right after.
+     * @param buf The part of a region to expose. The region should have been registered with IBV_ACCESS_MW_BIND
+     * (see `RdmaOptions::send_access` and `RdmaOptions::recv_access`).
+     * @param access The remote access of the peer, IBV_ACCESS_REMOTE_READ and/or IBV_ACCESS_REMOTE_WRITE.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags, the completion is a IBV_WC_BIND_MW.
+     * @param qp_index The QP to post to, only this QP of the peer can use the window.
+     * @returns The new rkey of the window, the previous one is not valid anymore.
+     */
+    uint32_t post_bind_window(ibv_mw* mw, const Buffer& buf, int access, bool cqe_event = false, size_t qp_index = 0);
+
+    /**
+     * Post a local invalidation of a memory window: the peer can not use `rkey` anymore.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags, the completion is a IBV_WC_LOCAL_INV.
+     * @param qp_index Should be the QP the window was bound on.
+     */
+    void post_invalidate(uint32_t rkey, bool cqe_event = false, size_t qp_index = 0);
+
+    /**
+     * @returns The private data the server sent when accepting the connection (client only).
+     * @see RdmaServer::set_private_data()
+     */
+    const std::vector<uint8_t>& get_peer_private_data() const
+    {
+        return m_peer_private_data;
+    }
+
+    /**
+     * Trace the operations of the connection, and the handlers of `msg_recv()`.
+     * Only the work requests that generate a completion are traced.
+     * @param tracer Not owned, it should outlive the connection. nullptr to stop tracing.
+     */
+    void set_tracer(RdmaTracer* tracer)
+    {
+        m_tracer = tracer;
+    }
+
+    /**
+     * @returns The tracer set with `set_tracer()`, or nullptr.
+     */
+    RdmaTracer* get_tracer() const
+    {
+        return m_tracer;
+    }
+
+    /**
+     * @returns true if the completions are timestamped by the NIC.
+     * @see RdmaOptions::completion_timestamps
+     */
+    bool has_hardware_timestamps() const
+    {
+        return m_cq_ex != nullptr;
+    }
+
     /**
      * Wait the next RDMA connection manager event.
      * Wait only one event.
@@ -73,14 +224,95 @@ public:
      */
     rdma_cm_event wait_cm_event();
 
+    /**
+     * Make a `wait_cm_event()` blocked in another thread (e.g. in `wait_until_connected()`) throw,
+     * or the next one if none is blocked.
+     */
+    void interrupt_cm_wait();
+
     /**
      * Wait the next completion queue event.
      * Wait only one event.
      * Blocking until an event occurs.
      * @returns The event that occured.
+     * @throws helper_rdma::WcError If the completion has a failed status.
+     * @throws helper_rdma::Error If the peer disconnected while waiting.
      */
     ibv_wc wait_event();
 
+    /**
+     * Non-blocking version of `wait_event()`.
+     * @param[out] wc The event that occured, if any.
+     * @returns true if an event was polled.
+     * @throws helper_rdma::WcError If the completion has a failed status.
+     */
+    bool poll_event(ibv_wc& wc);
+
+    /**
+     * @returns The options of the connection.
+     * Once connected, the `RdmaOptions::device_max` values are replaced by the actual device limits.
+     */
+    const RdmaOptions& get_options() const
+    {
+        return m_options;
+    }
+
+    /**
+     * @returns The number of QPs of the connection.
+     */
+    size_t num_qps() const
+    {
+        return m_qps.size();
+    }
+
+    /**
+     * @returns The `qp_num` of a connected QP, to match its completions in `ibv_wc.qp_num`.
+     * @note Throw an error if the QP does not exist.
+     */
+    uint32_t get_qp_num(size_t qp_index)
+    {
+        return get_qp(qp_index)->qp_num;
+    }
+
+    /**
+     * Set how `select_qp()` distributes the operations.
+     */
+    void set_ordering(Ordering ordering)
+    {
+        m_ordering = ordering;
+    }
+
+    /**
+     * Choose the QP of the next operation, following the ordering set with `set_ordering()`.
+     * @param key Used by `Ordering::PerKey`, operations with the same key are ordered.
+     * @returns The QP index, to give to the `post_*` functions.
+     */
+    size_t select_qp(uint64_t key = 0);
+
+    /**
+     * @returns true if a QP does not exist or is in an error state (IBV_QPS_ERR or IBV_QPS_SQE),
+     * meaning no more work can complete until `reconnect()` is called.
+     */
+    bool is_qp_error();
+
+    /**
+     * Destroy the current QP and establish a new connection to the same peer.
+     * The protection domain, completion queue and memory regions are reused, no memory is registered again.
+     * Blocking.
+     * @note Completions still in the CQ (usually flushed work requests) are discarded.
+     */
+    virtual void reconnect() = 0;
+
+    /**
+     * Set how many times `msg_send` and `msg_recv` reconnect and retry on failure before throwing.
+     * Default is 0: errors are propagated to the caller.
+     * @note A request may be delivered twice if the connection fails after it was received by the peer.
+     */
+    void set_max_reconnects(int max_reconnects)
+    {
+        m_max_reconnects = max_reconnects;
+    }
+
     /**
      * Wait until the RDMA connection is setup, and the RDMA operations are ready to start.
      * Blocking.
@@ -120,6 +352,20 @@ public:
      */
     void wait_for_recv(uint32_t& size);
 
+    /**
+     * Wait until a RDMA read is complete.
+     * Blocking.
+     * @note Throw an error if the next operation in the CQ is not a IBV_WC_RDMA_READ.
+     */
+    void wait_for_read();
+
+    /**
+     * Wait until an atomic operation is complete, its result is then in the result buffer.
+     * Blocking.
+     * @note Throw an error if the next operation in the CQ is not a IBV_WC_FETCH_ADD or IBV_WC_COMP_SWAP.
+     */
+    void wait_for_atomic();
+
     /**
      * Same as `wait_for_recv()` but with a payload.
      * The other difference is that it ignores all CQEs which are not "recv with immediate".
@@ -137,14 +383,16 @@ public:
      */
     Buffer msg_send(uint32_t request_sz)
     {
-        post_receive();
-        post_send(request_sz);
+        return with_reconnect([&] {
+            post_receive();
+            post_send(request_sz);
 
-        Buffer response;
-        response.data = m_recv_buf.data();
-        wait_for_1send_1recv(response.size);
+            Buffer response;
+            response.data = m_recv_buf.data();
+            wait_for_1send_1recv(response.size);
 
-        return response;
+            return response;
+        });
     }
 
     /**
@@ -157,56 +405,239 @@ public:
     template<typename Handler>
     void msg_recv(Handler handler)
     {
-        post_receive();
+        with_reconnect([&] {
+            post_receive();
+
+            uint32_t request_sz;
+            wait_for_recv(request_sz);
 
-        uint32_t request_sz;
-        wait_for_recv(request_sz);
+            uint32_t response_sz;
+            const uint64_t handler_begin_ns = m_tracer ? RdmaTracer::now() : 0;
+            handler(request_sz, response_sz);
 
-        uint32_t response_sz;
-        handler(request_sz, response_sz);
+            if(m_tracer)
+            {
+                m_tracer->on_handler(123, handler_begin_ns, RdmaTracer::now()); // wr_id of `post_receive()`
+            }
 
-        post_send(response_sz);
-        wait_for_send();
+            post_send(response_sz);
+            wait_for_send();
+        });
     }
 
     /**
      * Post a receive work request (WR)
+     * @param qp_index The QP to post to.
+     */
+    void post_receive(size_t qp_index = 0);
+
+    /**
+     * Post a receive work request (WR) for a part of the receiving buffer.
+     * @param recv_buf Where to receive, should point in the receiving buffer of this class.
+     * @param wr_id Identifier of the work request, returned in the `ibv_wc` of its completion.
+     * @param qp_index The QP to post to.
      */
-    void post_receive();
+    void post_receive(const Buffer& recv_buf, uint64_t wr_id, size_t qp_index = 0);
+
+    /**
+     * Post a receive work request (WR) in a region registered outside of the connection,
+     * e.g. a block of `RdmaBufferPool`.
+     * @param lkey The local key of the region.
+     */
+    void post_receive_lkey(const Buffer& recv_buf, uint32_t lkey, uint64_t wr_id, size_t qp_index = 0);
 
     /**
      * Post a send work request (WR).
      * @param size The size of the data to send.
      * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
      */
-    void post_send(uint32_t size, bool cqe_event = true);
+    void post_send(uint32_t size, bool cqe_event = true, size_t qp_index = 0);
+
+    /**
+     * Post a send work request (WR) for a part of the sending buffer.
+     * @param send_buf The data to send, should point in the sending buffer of this class.
+     * @param wr_id Identifier of the work request, returned in the `ibv_wc` of its completion.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
+     */
+    void post_send(const Buffer& send_buf, uint64_t wr_id, bool cqe_event = true, size_t qp_index = 0);
+
+    /**
+     * Post a send work request (WR) from a region registered outside of the connection,
+     * e.g. a block of `RdmaBufferPool`.
+     * @param lkey The local key of the region.
+     */
+    void post_send_lkey(const Buffer& send_buf, uint32_t lkey, uint64_t wr_id, bool cqe_event = true,
+                        size_t qp_index = 0);
 
     /**
      * Post a write work request.
      * @param send_buf The buffer to send.
-     * Should point in the sending buffer of this class.
+     * Should point in the sending buffer of this class, or in a region from `register_memory()`.
      * @param remote_addr, rkey The same fields as in `ibv_send_wr.rdma`.
-     * @note This will **not** generate a CQE neither on the sender or receiver side.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
+     * @note By default this will **not** generate a CQE neither on the sender or receiver side.
      */
-    void post_write(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey);
+    void post_write(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, bool cqe_event = false,
+                    size_t qp_index = 0);
 
     /**
      * Post a write with immediate work request.
      * @param send_buf The buffer to send.
-     * Should point in the sending buffer of this class.
+     * Should point in the sending buffer of this class, or in a region from `register_memory()`.
      * @param remote_addr, rkey The same fields as in `ibv_send_wr.rdma`.
      * @param payload The immediate data.
-     * @note This will **not** generate a CQE on the sender side, but it will generate one on the receiver side.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
+     * @note By default this will **not** generate a CQE on the sender side, but it will generate one on the receiver side.
+     */
+    void post_write_imm(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload,
+                        bool cqe_event = false, size_t qp_index = 0);
+
+    /**
+     * Post a read work request.
+     * @param local_buf Where to store the data read.
+     * Should point in the sending or receiving buffer of this class.
+     * @param remote_addr, rkey The same fields as in `ibv_send_wr.rdma`.
+     * The remote region should have been registered with IBV_ACCESS_REMOTE_READ.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
+     */
+    void post_read(const Buffer& local_buf, uint64_t remote_addr, uint32_t rkey, bool cqe_event = true,
+                   size_t qp_index = 0);
+
+    /**
+     * Post an atomic fetch and add work request: atomically add `add` to the remote 64 bits word.
+     * @param result_buf Where to store the value before the addition, 8 bytes.
+     * Should point in the sending or receiving buffer of this class.
+     * @param remote_addr, rkey The remote word, should be 8 bytes aligned
+     * and registered with IBV_ACCESS_REMOTE_ATOMIC.
+     * @param cqe_event If true, add IBV_SEND_SIGNALED to the send flags.
+     * @param qp_index The QP to post to.
+     */
+    void post_fetch_add(const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey, uint64_t add,
+                        bool cqe_event = true, size_t qp_index = 0);
+
+    /**
+     * Post an atomic compare and swap work request:
+     * atomically replace the remote 64 bits word by `swap` if it is equal to `compare`.
+     * @param result_buf Where to store the value before the operation, 8 bytes.
+     * The swap succeeded if it is equal to `compare`.
+     * @see post_fetch_add() for the other parameters.
+     */
+    void post_cmp_swap(const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey,
+                       uint64_t compare, uint64_t swap, bool cqe_event = true, size_t qp_index = 0);
+
+    /**
+     * Write a large buffer by splitting it over all the QPs, so that more than one NIC engine works on it.
+     * The chunks land directly at their offset in the remote memory, there is no reassembly step.
+     * With `Ordering::Strict`, only the first QP is used.
+     * Blocking until all the chunks are written in the remote memory.
+     * @param send_buf, remote_addr, rkey Same as `post_write()`.
+     * @note Throw an error if a completion which is not a write is polled.
+     */
+    void write_parallel(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey);
+
+    /**
+     * Same as `write_parallel()`, then notify the peer with an immediate data.
+     * The notification is only sent once all the chunks are written,
+     * so the peer sees the whole buffer when it receives `payload`.
+     * A receive should be posted on the peer first QP.
      */
-    void post_write_imm(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload);
+    void write_parallel_imm(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload);
 
     void disconnect()
     {
-        HENSURE_ERRNO(rdma_disconnect(m_connection_id) == 0);
+        HTHROW_ERRNO(rdma_disconnect(m_connection_id) == 0);
     }
 
 protected:
-    static void build_qp_init_attr(ibv_cq* const cq, ibv_qp_init_attr* out);
+    /**
+     * Run `op`, calling `reconnect()` and running it again if it throws,
+     * at most `m_max_reconnects` times.
+     */
+    template<typename Op>
+    auto with_reconnect(Op op) -> decltype(op())
+    {
+        for(int attempt = 0;; attempt++)
+        {
+            try
+            {
+                return op();
+            }
+            catch(const helper_rdma::Error& e)
+            {
+                if(attempt >= m_max_reconnects)
+                {
+                    throw;
+                }
+
+                reconnect_after_error(e, attempt);
+            }
+        }
+    }
+
+    // Log the error, then reconnect with backoff until success or `m_max_reconnects` is reached
+    void reconnect_after_error(const helper_rdma::Error& e, int& attempt);
+
+    // Disconnect and destroy the QPs and their IDs, and discard the completions left in the CQ
+    // The PD, CQ and MRs are kept
+    void destroy_qp();
+
+    // Copy of a CM event, already acknowledged
+    struct CmEvent
+    {
+        rdma_cm_event event{};
+        std::vector<uint8_t> private_data;
+    };
+
+    // Get the next event from the event channel, and acknowledge it
+    CmEvent get_cm_event();
+
+    // Throw if the peer disconnected, without blocking
+    // The other events are kept for `wait_cm_event()`
+    void check_disconnected();
+
+    // Post a send work request on a QP, throw if it fails
+    void post_send_wr(ibv_send_wr& wr, size_t qp_index = 0);
+
+    void post_atomic(ibv_wr_opcode opcode, const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey,
+                     uint64_t compare_add, uint64_t swap, bool cqe_event, size_t qp_index);
+
+    // Memory region containing `buf`, throw if there is none
+    ibv_mr* find_mr(const Buffer& buf);
+
+    // Local key of the memory region containing `buf`, throw if there is none
+    uint32_t get_lkey(const Buffer& buf);
+
+    // Get a connected QP, throw if it does not exist
+    ibv_qp* get_qp(size_t qp_index);
+
+    // Post writes of `send_buf` split over the QPs, returns how many were posted
+    int post_write_chunks(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey);
+
+    // Wait `count` write completions
+    void wait_for_writes(int count);
+
+    void build_qp_init_attr(ibv_cq* const cq, ibv_qp_init_attr* out) const;
+
+    // Build the connection parameters from the options
+    // `peer` is the parameters of the connection request, when accepting
+    void build_conn_param(rdma_conn_param* out, const rdma_conn_param* peer = nullptr) const;
+
+    // Apply the options that must be set on the ID before connecting
+    void setup_id(rdma_cm_id* const id);
+
+    // Apply the options that must be set on the ID of the QP `qp_index` before resolving its route
+    void setup_route(rdma_cm_id* const id, size_t qp_index);
+
+    // Apply the options that can only be set once connected, and check the negotiated ones
+    void on_qp_established(size_t qp_index);
+
+    // Replace `device_max` in the options by the device limits and check the values fit in them
+    void validate_options(const ibv_device_attr& device_attr);
 
     // returns false to stop the RDMA connection, or true to continue the polling loop.
     virtual bool on_event_received(rdma_cm_event* const event) = 0;
@@ -214,16 +645,61 @@ protected:
     // Setup the context (if not already exists) from the ibv_context
     void setup_context(ibv_context* const context);
 
+    // Create `m_cq_ex` with completion timestamps, leave it to nullptr if the device does not support them
+    void create_timestamped_cq(ibv_context* const context);
+
+    // Poll one completion without checking its status, `timestamp` is only set with `m_cq_ex`
+    bool poll_cq(ibv_wc& wc, uint64_t& timestamp);
+
+    // Convert a completion timestamp of the NIC to `RdmaTracer::now()` time
+    uint64_t hardware_to_host_ns(uint64_t timestamp, uint64_t poll_ns);
+
     // For the connection manager
     rdma_event_channel* m_event_channel = nullptr;
 
-    // The QP used to exchange data
-    // This should be set by the child class
-    ibv_qp* m_qp = nullptr;
+    // eventfd to interrupt the wait of a CM event
+    int m_interrupt_fd = -1;
+
+    struct QueuePair
+    {
+        // The ID associated to the QP
+        rdma_cm_id* id = nullptr;
 
-    // The ID associated to the QP
+        // nullptr until the QP is created
+        ibv_qp* qp = nullptr;
+    };
+
+    // Sent by the client as private data of each connection request,
+    // so the server knows which QP of the connection is being connected
+    struct ConnectInfo
+    {
+        uint16_t qp_index;
+        uint16_t num_qps;
+    };
+
+    // The QPs used to exchange data, the first one is the one of `msg_send`/`msg_recv`
     // This should be set by the child class
-    rdma_cm_id* m_qp_id = nullptr;
+    std::vector<QueuePair> m_qps;
+
+    RdmaOptions m_options;
+
+    Ordering m_ordering = Ordering::Strict;
+    size_t m_next_qp = 0;
+
+    // Events consumed by `check_disconnected()` that are not disconnections, returned first by `wait_cm_event()`
+    std::deque<CmEvent> m_deferred_cm_events;
+
+    // Copy of the private data of the last event returned by `wait_cm_event()`
+    std::vector<uint8_t> m_event_private_data;
+
+    // Connection parameters of the last event returned by `wait_cm_event()`, without private data
+    rdma_conn_param m_event_conn_param{};
+
+    // Private data received when the connection was established
+    std::vector<uint8_t> m_peer_private_data;
+
+    // Regions from `register_memory()`
+    std::vector<ibv_mr*> m_extra_mrs;
 
     // This is the ID for the connection itself
     // Created/Destroyed by RdmaBase
@@ -238,6 +714,25 @@ protected:
     ibv_mr* m_recv_mr = nullptr;
     ibv_comp_channel* m_comp_channel = nullptr;
 
+    // Same CQ as `m_cq` when it has completion timestamps, nullptr otherwise
+    ibv_cq_ex* m_cq_ex = nullptr;
+
+    // Frequency of the timestamps in kHz
+    uint64_t m_hca_core_clock = 0;
+
+    // Offset from the NIC clock to the host one, re-estimated every second because the clocks drift.
+    // The smallest gap between a completion and its poll of the previous and the current second
+    int64_t m_clock_offset_ns = INT64_MAX;
+    int64_t m_next_clock_offset_ns = INT64_MAX;
+    uint64_t m_clock_window_end_ns = 0;
+
+    RdmaTracer* m_tracer = nullptr;
+
+    // `ibv_device_cap_flags` of the device
+    unsigned int m_device_cap_flags = 0;
+
+    int m_max_reconnects = 0;
+
 private:
     std::vector<uint8_t> m_send_buf;
     std::vector<uint8_t> m_recv_buf;
@@ -6,10 +6,17 @@
 class RdmaClient : public RdmaBase
 {
 public:
-    RdmaClient(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port);
+    /**
+     * @param local_addr If not empty, the local IP address to connect from.
+     * This selects the device (and port) used by the connection, when the host has more than one.
+     * @param options Queue sizes and QP attributes, see `RdmaOptions`.
+     */
+    RdmaClient(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port,
+               const std::string& local_addr = "", const RdmaOptions& options = {});
     ~RdmaClient() override;
 
     void wait_until_connected() override;
+    void reconnect() override;
 
 protected:
     bool on_event_received(rdma_cm_event* const event) override;
@@ -18,4 +25,10 @@ protected:
     void on_route_resolved(rdma_cm_id* const id);
     void on_connect(rdma_cm_id* const id);
     void on_disconnect(rdma_cm_id* const id);
+
+    // Start resolving the server address on `id`
+    void resolve_addr(rdma_cm_id* const id);
+
+    sockaddr_in m_server_addr{};
+    sockaddr_in m_local_addr{};
 };
\ No newline at end of file
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "rdma_client.h"
+#include "rdma_server.h"
+#include <deque>
+#include <memory>
+#include <string>
+
+/**
+ * Collective operations between `size()` processes (ranks) connected in a ring.
+ *
+ * Each rank listens for its left neighbour with a `RdmaServer`, and connects to its right neighbour with a
+ * `RdmaClient`. Data only flows to the right: it is written with RDMA WRITE_WITH_IMM in staging slots of the
+ * right neighbour, which returns a credit with a send once a slot is processed.
+ * Large buffers are split in segments, so the segments are forwarded before the whole buffer arrives.
+ *
+ * All the ranks should call the same collectives, in the same order, with the same sizes.
+ */
+class RdmaCommunicator
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Address a rank listens on.
+     */
+    struct Endpoint
+    {
+        std::string addr;
+        int port{0};
+    };
+
+    enum class ReduceOp
+    {
+        Sum,
+        Prod,
+        Min,
+        Max
+    };
+
+    /**
+     * Connect the ring. Blocking until both neighbours are connected.
+     * @param ranks The address of every rank, in the same order for all the ranks.
+     * @param rank The index of this process in `ranks`.
+     * @param segment_size Size of a staging slot, the unit of pipelining.
+     * @param num_slots Number of staging slots, the number of segments in flight between two ranks.
+     * @param options Options of both connections, `RdmaOptions::prepost_receive` is ignored.
+     */
+    RdmaCommunicator(const std::vector<Endpoint>& ranks, size_t rank, uint32_t segment_size = 256 * 1024,
+                     uint32_t num_slots = 4, const RdmaOptions& options = {});
+
+    size_t rank() const
+    {
+        return m_rank;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Copy `size` bytes of `data` from the rank `root` to all the other ranks.
+     * The segments are forwarded along the ring as soon as they arrive.
+     * Blocking.
+     */
+    void broadcast(void* data, size_t size, size_t root);
+
+    /**
+     * Gather `block_size` bytes of every rank in all the ranks.
+     * Blocking.
+     * @param in The block of this rank.
+     * @param out `size() * block_size` bytes, the block of rank i is at offset `i * block_size`.
+     */
+    void all_gather(const void* in, void* out, size_t block_size);
+
+    /**
+     * Reduce `count` elements of every rank, element-wise, and store the result in all the ranks.
+     * Ring algorithm: a reduce-scatter then an all-gather, each rank sends 2(n-1)/n of the buffer,
+     * which is the minimum for large buffers.
+     * Blocking.
+     * @tparam T float, double, int32_t, uint32_t, int64_t or uint64_t.
+     */
+    template<typename T>
+    void all_reduce(T* data, size_t count, ReduceOp op = ReduceOp::Sum);
+
+private:
+    // Element-wise reduction of `src` into `dst`
+    using ReduceFn = void (*)(void* dst, const void* src, size_t bytes);
+
+    // A part of a user buffer sent or received in one staging slot
+    struct Segment
+    {
+        uint8_t* data;
+        uint32_t size;
+
+        // When received: reduce into `data` instead of copying
+        bool reduce;
+    };
+
+    // A received segment waiting in a staging slot
+    struct Arrival
+    {
+        uint32_t slot;
+        uint32_t size;
+    };
+
+    // Sent by each rank to its left neighbour once connected
+    struct SlotsInfo
+    {
+        uint64_t addr;
+        uint32_t rkey;
+        uint32_t num_slots;
+        uint32_t segment_size;
+        uint32_t reserved;
+    };
+
+    void connect(const std::vector<Endpoint>& ranks, const RdmaOptions& options);
+    void exchange_slots_info();
+
+    // Split `size` bytes in segments of whole elements
+    void split(std::vector<Segment>& segments, uint8_t* data, size_t size, size_t elem_size, bool reduce) const;
+
+    // Send `out` to the right and receive `in` from the left, in parallel.
+    // The segment `out[i]` is only sent once `in[i - lag]` is received, because it is the data it carries.
+    void run(const std::vector<Segment>& out, const std::vector<Segment>& in, size_t lag, ReduceFn reduce);
+
+    void reduce_scatter_all_gather(uint8_t* data, size_t count, size_t elem_size, ReduceFn reduce);
+
+    // Poll both CQs without blocking: credits from the right, segments from the left
+    void poll_completions();
+
+    // Copy a segment in a staging slot of the right neighbour, returns false if there is no credit
+    bool try_send(const Segment& segment);
+
+    // Process the next arrived segment, then give its slot back to the left neighbour
+    void receive(const Segment& segment, ReduceFn reduce);
+
+    size_t m_rank;
+    size_t m_size;
+    uint32_t m_segment_sz;
+    uint32_t m_num_slots;
+
+    // Connection to the right neighbour, which we send to
+    std::unique_ptr<RdmaClient> m_next;
+
+    // Connection from the left neighbour, which sends to us
+    std::unique_ptr<RdmaServer> m_prev;
+
+    // Staging slots of the right neighbour
+    SlotsInfo m_remote{};
+
+    // Staging slots of the right neighbour we can write to
+    uint32_t m_credits = 0;
+
+    // Sequence numbers of the segments, they select the slot
+    uint64_t m_send_seq = 0;
+    uint64_t m_recv_seq = 0;
+
+    std::deque<Arrival> m_arrivals;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "rdma_base.h"
+
+/**
+ * Codecs of the compressed streams, chosen per chunk.
+ */
+enum class RdmaCodec : uint16_t
+{
+    /**
+     * No compression.
+     */
+    Raw = 0,
+
+    /**
+     * Runs of zero bytes are replaced by their length. For sparse data.
+     */
+    ZeroRun = 1,
+
+    /**
+     * Difference between consecutive 32 bits words, then `ZeroRun`.
+     * For slowly varying integers, like counters, indices or timestamps.
+     */
+    DeltaZeroRun = 2
+};
+
+/**
+ * Header of each chunk of a compressed stream, followed by the encoded chunk.
+ */
+struct RdmaChunkHeader
+{
+    /**
+     * Size of the whole message, the same in all its chunks.
+     */
+    uint64_t total_size;
+
+    /**
+     * Size of the chunk once decoded.
+     */
+    uint32_t raw_size;
+
+    /**
+     * See `RdmaCodec`.
+     */
+    uint16_t codec;
+
+    uint16_t reserved;
+};
+
+/**
+ * Send large messages compressed chunk by chunk, to a `RdmaCompressedReceiver`.
+ *
+ * For links that are the bottleneck (shared or oversubscribed): the CPU compresses the next chunk while the NIC
+ * sends the current one. The codec is chosen per chunk: every `probe_interval` chunks all the codecs are tried
+ * and the smallest output wins, and a codec that stops compressing falls back to `RdmaCodec::Raw`.
+ *
+ * The connection should be created with `RdmaOptions::prepost_receive` disabled,
+ * and should not be used for `msg_send`/`msg_recv` at the same time.
+ */
+class RdmaCompressedSender
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * How often all the codecs are tried again, in chunks.
+     */
+    static constexpr uint32_t probe_interval = 16;
+
+    /**
+     * @param chunk_size Size of a chunk before compression. Should be the same for the receiver.
+     * @param num_slots Number of chunks in flight. Should be the same for the receiver.
+     * The sending buffer should hold `num_slots` chunks and their header.
+     */
+    RdmaCompressedSender(RdmaBase& conn, uint32_t chunk_size = 256 * 1024, uint32_t num_slots = 4);
+
+    /**
+     * Send a message.
+     * Blocking until all the chunks are posted, the last ones may still be in flight.
+     */
+    void send(const void* data, size_t size);
+
+    /**
+     * @returns The number of bytes given to `send()`, since the creation.
+     */
+    uint64_t raw_bytes() const
+    {
+        return m_raw_bytes;
+    }
+
+    /**
+     * @returns The number of bytes actually sent, headers included, since the creation.
+     */
+    uint64_t wire_bytes() const
+    {
+        return m_wire_bytes;
+    }
+
+private:
+    // Wait for a credit of the receiver and a free sending slot
+    uint32_t acquire_slot();
+
+    // Encode a chunk in `out`, choosing the codec, returns the encoded size
+    uint32_t encode_chunk(const uint8_t* in, uint32_t size, uint8_t* out, RdmaCodec& codec);
+
+    void process_completion(const ibv_wc& wc);
+
+    Buffer send_slot(uint32_t i);
+    Buffer credit_slot(uint32_t i);
+
+    RdmaBase& m_conn;
+    uint32_t m_chunk_sz;
+    uint32_t m_num_slots;
+
+    // Chunks the receiver can accept
+    uint32_t m_credits;
+    std::vector<uint32_t> m_free_slots;
+
+    // Codec used between two probes
+    RdmaCodec m_codec = RdmaCodec::Raw;
+    uint32_t m_chunks_since_probe = probe_interval;
+
+    // For the delta codec
+    std::vector<uint8_t> m_scratch;
+
+    uint64_t m_raw_bytes = 0;
+    uint64_t m_wire_bytes = 0;
+};
+
+/**
+ * Receive the messages of a `RdmaCompressedSender`, decompressing them chunk by chunk.
+ * @see RdmaCompressedSender for the requirements on the connection.
+ */
+class RdmaCompressedReceiver
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * @param chunk_size, num_slots Should be the same as the sender.
+     * The receiving buffer should hold `num_slots` chunks and their header.
+     */
+    RdmaCompressedReceiver(RdmaBase& conn, uint32_t chunk_size = 256 * 1024, uint32_t num_slots = 4);
+
+    /**
+     * Receive a message.
+     * Blocking.
+     * @param data Where to decompress the message.
+     * @param capacity The size of `data`, throw if the message is larger.
+     * @returns The size of the message.
+     */
+    size_t receive(void* data, size_t capacity);
+
+private:
+    Buffer recv_slot(uint32_t i);
+    Buffer credit_slot(uint32_t i);
+
+    RdmaBase& m_conn;
+    uint32_t m_chunk_sz;
+    uint32_t m_num_slots;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "rdma_base.h"
+#include <deque>
+#include <string>
+
+/**
+ * Control message of a file transfer, sent with two-sided sends.
+ * The data itself is moved with RDMA WRITEs, directly from the source mapping to the destination mapping.
+ */
+struct RdmaFileControl
+{
+    enum Type : uint32_t
+    {
+        /**
+         * Sender to receiver: a file of `size` bytes starts.
+         */
+        BEGIN = 1,
+
+        /**
+         * Receiver to sender: the window `window` of the file, [offset, offset + size), is writable at addr/rkey.
+         */
+        GRANT = 2,
+
+        /**
+         * Sender to receiver: all the writes of the window `window` are complete.
+         */
+        DONE = 3,
+
+        /**
+         * Sender to receiver: the file is complete.
+         */
+        END = 4,
+
+        /**
+         * Receiver to sender: the file is written and unmapped.
+         */
+        ACK = 5
+    };
+
+    uint32_t type;
+    uint32_t window;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t reserved;
+};
+
+/**
+ * Common part of the file sender and receiver: control messages in small slots of the connection buffers,
+ * and the completions of the data writes.
+ *
+ * The connection should be created with `RdmaOptions::prepost_receive` disabled,
+ * and should not be used for `msg_send`/`msg_recv` during a transfer.
+ */
+class RdmaFileStream
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Number of control messages that can be received before they are processed.
+     */
+    static constexpr uint32_t num_control_slots = 8;
+
+    explicit RdmaFileStream(RdmaBase& conn);
+
+protected:
+    // Send a control message, waiting for a free sending slot if needed
+    void post_control(const RdmaFileControl& msg);
+
+    // Get the next control message if one already arrived, without blocking
+    bool try_pop_control(RdmaFileControl& msg);
+
+    // Wait for the next control message, throw if it is not of type `expected`
+    RdmaFileControl wait_control(RdmaFileControl::Type expected);
+
+    // Wait until all the control messages are sent, so no completion is left for the next user of the connection
+    void wait_sends();
+
+    // Process one completion, blocking
+    void process_one_completion();
+
+    RdmaBase& m_conn;
+
+    // Data writes posted and not completed yet
+    uint32_t m_writes_in_flight = 0;
+
+private:
+    Buffer send_slot(uint32_t i);
+    Buffer recv_slot(uint32_t i);
+
+    void process_completion(const ibv_wc& wc);
+
+    std::vector<uint32_t> m_free_send_slots;
+    std::deque<RdmaFileControl> m_inbox;
+};
+
+/**
+ * Send files to a `RdmaFileReceiver` without copying them in user space.
+ *
+ * The file is mapped with mmap(), and the mapped pages are written directly in the destination mapping with RDMA
+ * WRITEs. If the device supports on-demand paging, the whole mapping is registered once without pinning it.
+ * Otherwise, it is registered window by window, the next window being registered while the current one is written.
+ */
+class RdmaFileSender : public RdmaFileStream
+{
+public:
+    /**
+     * @param conn A connected connection, see `RdmaFileStream`.
+     * @param chunk_size Size of one RDMA WRITE.
+     * Large enough to amortize the cost of a work request, small enough to keep several in flight.
+     */
+    explicit RdmaFileSender(RdmaBase& conn, uint32_t chunk_size = 1024 * 1024);
+
+    /**
+     * Send a whole file.
+     * Blocking until the receiver has written it.
+     */
+    void send(const std::string& path);
+
+private:
+    // Register the part of the source mapping needed for a granted window
+    ibv_mr* register_window(uint8_t* file_data, const RdmaFileControl& grant);
+    void deregister_window(ibv_mr* mr);
+
+    // Post the writes of a window, registering the next window while the send queue is full
+    void post_window(uint8_t* file_data, const RdmaFileControl& grant, bool has_next,
+                     RdmaFileControl& next_grant, ibv_mr*& next_mr);
+
+    uint32_t m_chunk_sz;
+    uint32_t m_max_writes_in_flight;
+
+    // Whole mapping registered with on-demand paging, nullptr if windows are registered one by one
+    ibv_mr* m_file_mr = nullptr;
+};
+
+/**
+ * Receive files sent by `RdmaFileSender`.
+ *
+ * The destination file is mapped with mmap() and its windows are exposed to the sender, which writes them
+ * directly. Two windows are granted at any time, so the registration of the next window is hidden behind
+ * the transfer of the current one.
+ */
+class RdmaFileReceiver : public RdmaFileStream
+{
+public:
+    /**
+     * @param conn A connected connection, see `RdmaFileStream`.
+     * @param window_size Size of the registered windows when on-demand paging is not supported.
+     * This is the memory pinned at most twice during a transfer.
+     */
+    explicit RdmaFileReceiver(RdmaBase& conn, uint64_t window_size = 64 * 1024 * 1024);
+
+    /**
+     * Receive a whole file, created or truncated at `path`.
+     * Blocking until the sender has sent it.
+     * @returns The size of the file.
+     */
+    uint64_t receive(const std::string& path);
+
+private:
+    // Register and grant a window of the destination mapping
+    void grant_window(uint8_t* file_data, uint64_t file_sz, uint32_t window);
+
+    uint64_t m_window_sz;
+
+    // Whole mapping registered with on-demand paging, nullptr if windows are registered one by one
+    ibv_mr* m_file_mr = nullptr;
+
+    // Registrations of the granted windows, indexed by window % 2
+    ibv_mr* m_window_mrs[2] = {nullptr, nullptr};
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "rdma_base.h"
+#include "rdma_server.h"
+
+/**
+ * Published by the server in the connection private data, so the clients can read the table.
+ */
+struct RdmaKvDescriptor
+{
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t num_buckets;
+    uint32_t max_value_size;
+    uint32_t reserved;
+};
+
+/**
+ * One entry of the table, followed by the value (padded to 8 bytes).
+ *
+ * The server writes an entry like a seqlock: `version` is odd while the entry is modified.
+ * The `checksum` covers all the fields and the value, so a client RDMA READ torn by a concurrent update
+ * is detected even if it sees an even version.
+ */
+struct RdmaKvEntry
+{
+    uint64_t version;
+    uint64_t key;
+    uint32_t occupied;
+    uint32_t value_size;
+    uint64_t checksum;
+};
+
+/**
+ * Layout of the hash table shared by the server and the clients.
+ *
+ * Each key has two candidate buckets (two-choice hashing), so a lookup needs at most two RDMA READs.
+ * A bucket holds `entries_per_bucket` entries.
+ */
+class RdmaKvLayout
+{
+public:
+    static constexpr uint32_t entries_per_bucket = 4;
+
+    RdmaKvLayout() = default;
+    RdmaKvLayout(uint32_t num_buckets, uint32_t max_value_size);
+
+    /**
+     * @returns The size of one entry, with its value.
+     */
+    uint32_t entry_size() const
+    {
+        return m_entry_sz;
+    }
+
+    /**
+     * @returns The size of one bucket, which is the size of one RDMA READ.
+     */
+    uint32_t bucket_size() const
+    {
+        return m_entry_sz * entries_per_bucket;
+    }
+
+    uint32_t num_buckets() const
+    {
+        return m_num_buckets;
+    }
+
+    uint32_t max_value_size() const
+    {
+        return m_max_value_sz;
+    }
+
+    /**
+     * @returns The two candidate buckets of `key`.
+     */
+    void buckets_of(uint64_t key, uint32_t& first, uint32_t& second) const;
+
+    /**
+     * @returns The checksum of an entry and its value, the `checksum` field being ignored.
+     */
+    static uint64_t checksum(const RdmaKvEntry& entry, const uint8_t* value);
+
+private:
+    uint32_t m_num_buckets{0};
+    uint32_t m_max_value_sz{0};
+    uint32_t m_entry_sz{0};
+};
+
+/**
+ * Server side of the remote-memory key-value cache.
+ *
+ * The table lives in a memory region registered with IBV_ACCESS_REMOTE_READ.
+ * Its address and rkey are published to the clients at connection time, then the clients do GETs with
+ * one-sided RDMA READs, without using the server CPU.
+ * Updates are done by the server only, locally or on request of the clients through `msg_recv`.
+ */
+class RdmaKvServer
+{
+public:
+    /**
+     * Allocate and register the table, and publish it in the private data of `server`.
+     * @param server Should be bound to the address of a device, and not connected yet.
+     * @param num_buckets, max_value_size Capacity of the table, it never grows.
+     */
+    RdmaKvServer(RdmaServer& server, uint32_t num_buckets, uint32_t max_value_size);
+    ~RdmaKvServer();
+
+    RdmaKvServer(const RdmaKvServer&) = delete;
+    RdmaKvServer& operator=(const RdmaKvServer&) = delete;
+
+    /**
+     * Insert or update a key.
+     * @returns false if both buckets of the key are full.
+     */
+    bool put(uint64_t key, const void* value, uint32_t size);
+
+    /**
+     * Remove a key.
+     * @returns false if the key does not exist.
+     */
+    bool erase(uint64_t key);
+
+    /**
+     * Process a PUT or ERASE request sent by `RdmaKvClient`.
+     * Should be called from the handler of `RdmaServer::msg_recv()`:
+     * ```
+     * server.msg_recv([&](uint32_t request_sz, uint32_t& response_sz) {
+     *     kv.handle_message(request_sz, response_sz);
+     * });
+     * ```
+     */
+    void handle_message(uint32_t request_sz, uint32_t& response_sz);
+
+    const RdmaKvLayout& layout() const
+    {
+        return m_layout;
+    }
+
+private:
+    RdmaKvEntry* entry(uint32_t bucket, uint32_t i);
+    RdmaKvEntry* find(uint64_t key);
+
+    // Update an entry following the seqlock protocol
+    void write_entry(RdmaKvEntry* entry, uint64_t key, bool occupied, const void* value, uint32_t size);
+
+    RdmaServer& m_server;
+    RdmaKvLayout m_layout;
+
+    // uint64_t for the alignment of the entries
+    std::vector<uint64_t> m_table;
+    ibv_mr* m_table_mr{nullptr};
+};
+
+/**
+ * Client side of the remote-memory key-value cache.
+ */
+class RdmaKvClient
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * @param conn Connection to a server running a `RdmaKvServer`, already connected.
+     * @param scratch Where the buckets are read, in the buffers of `conn`.
+     * Should be at least `layout().bucket_size()` bytes, and not overlap the start of the receiving buffer
+     * which is used by `put()` and `erase()`.
+     */
+    RdmaKvClient(RdmaBase& conn, const Buffer& scratch);
+
+    /**
+     * Look up a key with one or two RDMA READs.
+     * Blocking.
+     * @param[out] value Where to copy the value.
+     * @param[in,out] size The capacity of `value`, then the size of the value.
+     * @returns false if the key does not exist.
+     */
+    bool get(uint64_t key, void* value, uint32_t& size);
+
+    /**
+     * Insert or update a key through the server.
+     * Blocking.
+     * @returns false if the table is full for this key.
+     */
+    bool put(uint64_t key, const void* value, uint32_t size);
+
+    /**
+     * Remove a key through the server.
+     * Blocking.
+     * @returns false if the key does not exist.
+     */
+    bool erase(uint64_t key);
+
+    const RdmaKvLayout& layout() const
+    {
+        return m_layout;
+    }
+
+private:
+    enum class Lookup
+    {
+        Found,
+        NotFound,
+        Torn
+    };
+
+    Lookup lookup_bucket(uint32_t bucket, uint64_t key, void* value, uint32_t& size);
+
+    RdmaBase& m_conn;
+    Buffer m_scratch;
+    RdmaKvDescriptor m_desc{};
+    RdmaKvLayout m_layout;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Capacities and attributes of an RDMA connection.
+ * The values are validated against the device limits (`ibv_query_device`) when the connection is setup.
+ */
+struct RdmaOptions
+{
+    /**
+     * Use the largest value supported by the device.
+     * Valid for the queue sizes and the outstanding READ/atomic depths.
+     */
+    static constexpr uint32_t device_max = UINT32_MAX;
+
+    /**
+     * Leave the attribute to its default value.
+     */
+    static constexpr uint8_t default_value = UINT8_MAX;
+
+    /**
+     * Number of entries of the completion queue, shared by all the QPs.
+     * Should be at least `num_qps * (max_send_wr + max_recv_wr)` so that it can not overflow.
+     */
+    uint32_t cq_size = 1'000;
+
+    /**
+     * Maximum number of outstanding work requests in the send and the receive queue of each QP.
+     */
+    uint32_t max_send_wr = 100;
+    uint32_t max_recv_wr = 100;
+
+    /**
+     * Maximum number of scatter/gather entries per work request.
+     */
+    uint32_t max_send_sge = 1;
+    uint32_t max_recv_sge = 1;
+
+    /**
+     * Maximum size of the data that can be sent inline (copied in the WQE instead of read by DMA).
+     */
+    uint32_t max_inline_data = 0;
+
+    /**
+     * Maximum number of outstanding RDMA READ and atomic operations the peer can issue to us.
+     */
+    uint32_t responder_resources = device_max;
+
+    /**
+     * Maximum number of outstanding RDMA READ and atomic operations we can issue to the peer.
+     */
+    uint32_t initiator_depth = device_max;
+
+    /**
+     * Number of retries on timeout, and on receiver not ready (RNR).
+     * The maximum is 7, which is infinite for `rnr_retry_count`.
+     */
+    uint8_t retry_count = 7;
+    uint8_t rnr_retry_count = 7;
+
+    /**
+     * Minimum RNR NAK timer, encoded as in the IB spec (1 = 0.01ms to 31 = 491.52ms, 0 = 655.36ms).
+     * Leave to `default_value` for the rdma_cm default.
+     */
+    uint8_t min_rnr_timer = default_value;
+
+    /**
+     * Local ACK timeout, 4.096us * 2^timeout. Leave to `default_value` for the rdma_cm default.
+     */
+    uint8_t timeout = default_value;
+
+    /**
+     * Path MTU required by the application.
+     * The MTU is negotiated by rdma_cm from the route, the connection fails if it is lower than this one.
+     * Leave to 0 to accept any MTU.
+     */
+    ibv_mtu path_mtu = static_cast<ibv_mtu>(0);
+
+    /**
+     * Number of QPs to open to the peer, sharing the same PD, CQ and memory regions.
+     * Only used by the client, the server accepts as many QPs as the client requests.
+     */
+    uint32_t num_qps = 1;
+
+    /**
+     * Type of service of each QP, by QP index: the IP ToS / traffic class on RoCE, mapped to a service level on
+     * InfiniBand. Applied by the client before resolving the route of each QP, the server follows the client path.
+     * The QPs without an entry, or with `default_value`, keep the rdma_cm default.
+     * Gives the QPs of `RdmaSendScheduler` different priorities in the network.
+     */
+    std::vector<uint8_t> type_of_service;
+
+    /**
+     * Access flags of the memory regions of the sending and the receiving buffers (`ibv_access_flags`).
+     * Add `IBV_ACCESS_REMOTE_READ` to let the peer READ a buffer,
+     * and `IBV_ACCESS_REMOTE_ATOMIC` to let it run atomics on it.
+     * Add `IBV_ACCESS_MW_BIND` to expose parts of a buffer with memory windows (see `RdmaWindowPool`).
+     */
+    int send_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+    int recv_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+
+    /**
+     * Pre-post one receive covering the whole receiving buffer when connecting,
+     * so that the first `msg_send`/`msg_recv` can not miss a message.
+     * Should be disabled when a layer manages its own receive slots (e.g. `RdmaRpcServer`).
+     */
+    bool prepost_receive = true;
+
+    /**
+     * Create an extended CQ with the completion timestamps of the NIC, if the device supports them,
+     * for the operations traced with `RdmaBase::set_tracer()`.
+     * Without them, the completions are timestamped when they are polled.
+     */
+    bool completion_timestamps = false;
+};
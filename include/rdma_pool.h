@@ -0,0 +1,140 @@
+#pragma once
+
+#include "rdma_base.h"
+#include <memory>
+#include <mutex>
+
+/**
+ * Pool of registered buffers in power-of-two size classes, for messages of variable size.
+ *
+ * The fixed sending and receiving buffers of a connection are sized for the largest message,
+ * and for each connection. The blocks of the pool are borrowed per message instead,
+ * so the memory follows the actual mix of message sizes, and is shared by the connections attached to the pool.
+ *
+ * Each size class is cut from large slabs, registered once in every attached connection.
+ * A block carries its lkey, so posting it needs no lookup (see `RdmaBase::post_send_lkey()`).
+ * Each thread keeps a small cache of free blocks per class: most `acquire()`/`release()` do not lock.
+ */
+class RdmaBufferPool
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    struct Slab;
+
+    /**
+     * A registered buffer borrowed from the pool.
+     */
+    struct Block
+    {
+        uint8_t* data = nullptr;
+
+        /**
+         * Size of the block, the size of its class.
+         */
+        uint32_t capacity = 0;
+
+        /**
+         * Local key in the first connection of the pool. See `lkey()` for the other ones.
+         */
+        uint32_t lkey = 0;
+
+        uint16_t size_class = 0;
+
+        // The slab the block is cut from
+        const Slab* slab = nullptr;
+
+        /**
+         * @returns The first `size` bytes of the block.
+         */
+        Buffer buffer(uint32_t size) const
+        {
+            return {data, size};
+        }
+    };
+
+    /**
+     * @param conn A connected connection, it should outlive the pool.
+     * @param min_block_size, max_block_size Sizes of the smallest and the largest class, powers of two.
+     * @param slab_size Bytes registered at once when a class is empty, at least one block.
+     * @param access The `ibv_access_flags` of the slabs.
+     */
+    explicit RdmaBufferPool(RdmaBase& conn, uint32_t min_block_size = 64, uint32_t max_block_size = 64 << 20,
+                            size_t slab_size = 16 << 20,
+                            int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    ~RdmaBufferPool();
+
+    RdmaBufferPool(const RdmaBufferPool&) = delete;
+    RdmaBufferPool& operator=(const RdmaBufferPool&) = delete;
+
+    /**
+     * Share the pool with another connection: the slabs are registered in its protection domain too.
+     * Should be called before the blocks are used from several threads.
+     * @param conn A connected connection, it should outlive the pool.
+     */
+    void attach(RdmaBase& conn);
+
+    /**
+     * Borrow a block of at least `size` bytes.
+     * Registers a new slab if the class is empty.
+     * Thread-safe.
+     * @note Throw an error if `size` is larger than the largest class.
+     */
+    Block acquire(uint32_t size);
+
+    /**
+     * Give back a block from `acquire()`, once the operations using it are completed.
+     * Thread-safe, any thread can release a block.
+     */
+    void release(const Block& block);
+
+    /**
+     * @returns The local key of `block` in an attached connection.
+     */
+    uint32_t lkey(const Block& block, const RdmaBase& conn) const;
+
+    /**
+     * @returns The size of the largest class.
+     */
+    uint32_t max_block_size() const
+    {
+        return m_max_block_size;
+    }
+
+    /**
+     * @returns The number of bytes registered by the pool (in each connection).
+     */
+    size_t registered_bytes() const;
+
+private:
+    // Free blocks shared by the threads, and kept alive by the thread caches until they give their blocks back
+    struct Central;
+
+    // Free blocks of a thread, of the class `size_class`
+    std::vector<Block>& thread_cache(uint16_t size_class);
+
+    // Number of blocks a thread cache holds at most
+    size_t cache_limit(uint16_t size_class) const;
+
+    // Move `count` free blocks from the central lists to `out`, registering a slab if needed
+    void refill(uint16_t size_class, std::vector<Block>& out, size_t count);
+
+    // Register a new slab of the class, and add its blocks to the central list (the class lock is held)
+    void grow(uint16_t size_class);
+
+    const uint32_t m_min_block_size;
+    const uint32_t m_max_block_size;
+    const size_t m_slab_size;
+    const int m_access;
+    uint16_t m_num_classes;
+    unsigned int m_min_shift;
+
+    std::shared_ptr<Central> m_central;
+
+    // Attached connections, in the order of `Slab::mrs`
+    std::vector<RdmaBase*> m_conns;
+
+    // Protects the slabs and their regions
+    mutable std::mutex m_slabs_mutex;
+    std::vector<std::unique_ptr<Slab>> m_slabs;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Bounded lock-free queue with multiple producers and multiple consumers.
+ *
+ * Each cell has a sequence number telling whether it is ready to be written or read for the current lap,
+ * so producers and consumers only contend on their own index (Vyukov's algorithm).
+ * @tparam T Should be cheap to copy, it is copied in and out of the cells.
+ */
+template<typename T>
+class RdmaMpmcQueue
+{
+public:
+    /**
+     * @param capacity Rounded up to a power of two.
+     */
+    explicit RdmaMpmcQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while(size < capacity)
+        {
+            size *= 2;
+        }
+
+        m_mask = size - 1;
+        m_cells.reset(new Cell[size]);
+
+        for(size_t i = 0; i < size; i++)
+        {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RdmaMpmcQueue(const RdmaMpmcQueue&) = delete;
+    RdmaMpmcQueue& operator=(const RdmaMpmcQueue&) = delete;
+
+    /**
+     * @returns false if the queue is full.
+     */
+    bool try_push(const T& value)
+    {
+        Cell* cell;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            cell = &m_cells[pos & m_mask];
+            const size_t seq = cell->seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if(diff == 0)
+            {
+                // The cell is free for this lap, try to take it
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                // The cell still holds the value of the previous lap
+                return false;
+            }
+            else
+            {
+                // Another producer took it
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @returns false if the queue is empty.
+     */
+    bool try_pop(T& value)
+    {
+        Cell* cell;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            cell = &m_cells[pos & m_mask];
+            const size_t seq = cell->seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if(diff == 0)
+            {
+                if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                // Not written yet
+                return false;
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = cell->value;
+
+        // Free for the next lap
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+
+    // On their own cache line, producers and consumers do not share them
+    alignas(64) std::atomic<size_t> m_enqueue_pos{0};
+    alignas(64) std::atomic<size_t> m_dequeue_pos{0};
+};
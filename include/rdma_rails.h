@@ -0,0 +1,218 @@
+#pragma once
+
+#include "rdma_base.h"
+#include <memory>
+#include <string>
+
+/**
+ * Multi-rail connection: one RDMA connection per device/port (rail) to the same peer.
+ *
+ * Each rail is a full `RdmaBase` with its own context, PD, CQ and buffers,
+ * because memory registrations cannot be shared between devices.
+ * Large messages are striped across all rails, small independent operations
+ * are spread over the rails by hash or by load.
+ */
+class RdmaRails
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Address of one rail.
+     * The address selects the device: each NIC should have its own IP address.
+     */
+    struct Endpoint
+    {
+        std::string addr;
+        int port{0};
+
+        /**
+         * Client only. If not empty, the local address to connect from, which selects the local device.
+         */
+        std::string local_addr;
+    };
+
+    /**
+     * How `select_rail()` picks the rail of an independent operation.
+     */
+    enum class Policy
+    {
+        /**
+         * The same key always goes to the same rail, which preserves the ordering per key.
+         */
+        Hash,
+
+        /**
+         * The rail with the fewest operations in flight.
+         */
+        LeastLoaded
+    };
+
+    /**
+     * Take the ownership of already created connections, one per rail.
+     * Both peers should have the same number of rails, in the same order.
+     */
+    explicit RdmaRails(std::vector<std::unique_ptr<RdmaBase>> rails);
+
+    /**
+     * Create one client per endpoint.
+     * @param send_buf_sz, recv_buf_sz Buffer sizes **per rail**.
+     * @param options Options of each rail.
+     */
+    static RdmaRails connect(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::vector<Endpoint>& endpoints,
+                             const RdmaOptions& options = {});
+
+    /**
+     * Create one server per endpoint.
+     * @param send_buf_sz, recv_buf_sz Buffer sizes **per rail**.
+     * @param options Options of each rail.
+     */
+    static RdmaRails listen(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::vector<Endpoint>& endpoints,
+                            const RdmaOptions& options = {});
+
+    /**
+     * Wait until all the rails are connected.
+     * Blocking.
+     */
+    void wait_until_connected();
+
+    /**
+     * @returns The number of rails.
+     */
+    size_t size() const
+    {
+        return m_rails.size();
+    }
+
+    /**
+     * @returns The connection of the rail `i`.
+     */
+    RdmaBase& rail(size_t i)
+    {
+        return *m_rails[i].conn;
+    }
+
+    /**
+     * Largest message that can be striped, this is the sum of the rail buffer sizes.
+     */
+    uint32_t max_striped_size();
+
+    /**
+     * Layout of a striped message: the message is cut in `size()` contiguous chunks,
+     * the chunk `i` is at the beginning of the buffer of the rail `i`.
+     * @returns The size of the chunk of rail `i` for a message of `total_sz` bytes.
+     */
+    uint32_t stripe_size(uint32_t total_sz, size_t i) const;
+
+    /**
+     * Copy a contiguous message into the send buffers of the rails, following the stripe layout.
+     * Writing directly in `rail(i).get_send_buf()` avoids the copy.
+     */
+    void scatter(const uint8_t* src, uint32_t size);
+
+    /**
+     * Copy the last striped message received into a contiguous buffer.
+     * @returns The number of bytes copied.
+     */
+    uint32_t gather(uint8_t* dst, uint32_t capacity);
+
+    /**
+     * Same as `RdmaBase::msg_send()`, but the request is striped across all the rails.
+     * The request should be laid out in the send buffers of the rails, see `stripe_size()`.
+     * @returns The total size of the response, which is striped in the receiving buffers of the rails.
+     */
+    uint32_t msg_send(uint32_t request_sz);
+
+    /**
+     * Receive counterpart of `msg_send()`.
+     * @param handler The method to execute to process the request.
+     * Should be of signature `void(uint32_t request_sz, uint32_t& response_sz)`,
+     * both sizes being the total over all the rails.
+     */
+    template<typename Handler>
+    void msg_recv(Handler handler)
+    {
+        for(Rail& rail : m_rails)
+        {
+            rail.conn->post_receive();
+        }
+
+        uint32_t request_sz = 0;
+        for(size_t i = 0; i < m_rails.size(); i++)
+        {
+            m_rails[i].conn->wait_for_recv(m_rails[i].last_recv_sz);
+            request_sz += m_rails[i].last_recv_sz;
+        }
+
+        uint32_t response_sz;
+        handler(request_sz, response_sz);
+
+        for(size_t i = 0; i < m_rails.size(); i++)
+        {
+            m_rails[i].conn->post_send(stripe_size(response_sz, i));
+        }
+
+        for(Rail& rail : m_rails)
+        {
+            rail.conn->wait_for_send();
+        }
+    }
+
+    /**
+     * Set the policy of `select_rail()`.
+     */
+    void set_policy(Policy policy)
+    {
+        m_policy = policy;
+    }
+
+    /**
+     * Pick the rail of an independent (not striped) operation.
+     * @param key Used by the `Hash` policy, for example a destination address or a stream ID.
+     */
+    size_t select_rail(uint64_t key) const;
+
+    /**
+     * Post a signaled RDMA write on one rail, and track its completion.
+     * The buffer should point in the sending buffer of the rail,
+     * the remote address and rkey should be the ones of the peer rail.
+     */
+    void post_write(size_t i, const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey);
+
+    /**
+     * Poll the completions of all the rails, without blocking.
+     * @returns The number of tracked operations that completed.
+     * @note Throw an error on a completion that is not a tracked write,
+     * so messages should not be in flight on the rails at the same time.
+     */
+    size_t poll_completions();
+
+    /**
+     * Wait until all the tracked operations of all the rails completed.
+     * Blocking.
+     */
+    void wait_all();
+
+    /**
+     * @returns The number of tracked operations in flight on the rail `i`.
+     */
+    uint32_t in_flight(size_t i) const
+    {
+        return m_rails[i].in_flight;
+    }
+
+private:
+    struct Rail
+    {
+        std::unique_ptr<RdmaBase> conn;
+
+        // Signaled operations posted but not yet completed
+        uint32_t in_flight{0};
+
+        // Size of the chunk received by the last striped message
+        uint32_t last_recv_sz{0};
+    };
+
+    std::vector<Rail> m_rails;
+    Policy m_policy{Policy::Hash};
+};
@@ -0,0 +1,405 @@
+#pragma once
+
+#include "rdma_base.h"
+#include "rdma_queue.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+/**
+ * Header at the beginning of each RPC message, followed by the payload.
+ */
+struct RpcHeader
+{
+    /**
+     * Chosen by the client, the response has the same ID as its request.
+     */
+    uint32_t request_id;
+
+    /**
+     * Method to call, registered in the server.
+     */
+    uint16_t method;
+
+    /**
+     * Only for responses, see `RpcStatus`.
+     */
+    uint16_t status;
+
+    /**
+     * Size of the payload, without the header.
+     */
+    uint32_t size;
+
+    // Keep the payload 16-bytes aligned
+    uint32_t reserved;
+};
+
+static_assert(sizeof(RpcHeader) == 16, "RpcHeader should be compact");
+
+enum RpcStatus : uint16_t
+{
+    RPC_OK = 0,
+    RPC_UNKNOWN_METHOD = 1,
+    RPC_BAD_REQUEST = 2,
+    RPC_HANDLER_ERROR = 3
+};
+
+/**
+ * Split the buffers of a connection into fixed-size slots, one message per slot.
+ * Used by both sides of the RPC layer.
+ */
+class RdmaRpcSlots
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Maximum payload alignment that handlers can rely on.
+     */
+    static constexpr size_t payload_alignment = 16;
+
+    RdmaRpcSlots(RdmaBase& conn, uint32_t num_slots);
+
+    /**
+     * @returns The number of slots, which is also the maximum number of requests in flight.
+     */
+    uint32_t num_slots() const
+    {
+        return m_num_slots;
+    }
+
+    /**
+     * @returns The maximum size of a payload.
+     */
+    uint32_t max_payload_size() const
+    {
+        return m_slot_sz - static_cast<uint32_t>(sizeof(RpcHeader));
+    }
+
+protected:
+    // The whole slot `i` of the sending/receiving buffer
+    Buffer send_slot(uint32_t i);
+    Buffer recv_slot(uint32_t i);
+
+    // Payload of a message, just after the header
+    static Buffer payload(const Buffer& slot, uint32_t size);
+
+    // Post the receive of the slot `i`, its wr_id is the slot index
+    void post_recv_slot(uint32_t i);
+
+    // Send the message in the send slot `i`, its wr_id is the slot index
+    void post_send_slot(uint32_t i);
+
+    // Get a free send slot, polling the completions until there is one
+    uint32_t acquire_send_slot();
+
+    // Process a completion: frees the send slots, or forwards the receives to `on_recv(slot, byte_len)`
+    template<typename OnRecv>
+    void process_completion(const ibv_wc& wc, OnRecv on_recv)
+    {
+        if(wc.opcode & IBV_WC_RECV)
+        {
+            on_recv(static_cast<uint32_t>(wc.wr_id), wc.byte_len);
+        }
+        else if(wc.opcode == IBV_WC_SEND)
+        {
+            m_free_send_slots.push_back(static_cast<uint32_t>(wc.wr_id));
+        }
+        else
+        {
+            THROW_ERROR("Unexpected completion opcode %d in RPC connection", static_cast<int>(wc.opcode));
+        }
+    }
+
+    // Called by `acquire_send_slot()` for the receive completions polled while waiting
+    virtual void on_recv(uint32_t slot, uint32_t byte_len) = 0;
+
+    RdmaBase& m_conn;
+    const uint32_t m_num_slots;
+    uint32_t m_slot_sz;
+
+    std::vector<uint32_t> m_free_send_slots;
+};
+
+/**
+ * Server side of the RPC layer.
+ *
+ * Handlers read the request in place in the receiving slot, and write the response in place in a sending slot.
+ * By default they run on the thread calling `poll()`/`serve_one()`. With `start_workers()`, this thread only
+ * drains the completions and the handlers run in a pool of worker threads.
+ * The connection should be created with `RdmaOptions::prepost_receive` disabled,
+ * and should not be used for `msg_send`/`msg_recv` at the same time.
+ */
+class RdmaRpcServer : public RdmaRpcSlots
+{
+public:
+    /**
+     * Process a request.
+     * @param request The payload of the request.
+     * @param response Where to write the response, its size is the maximum payload size.
+     * @returns The size of the response.
+     * @note A handler that throws, or returns a size larger than the maximum payload size,
+     * is answered with `RPC_HANDLER_ERROR` and an empty response.
+     */
+    using Handler = std::function<uint32_t(const Buffer& request, const Buffer& response)>;
+
+    /**
+     * @param num_slots Number of requests that can be processed at the same time.
+     * Should be the same as the client one.
+     */
+    RdmaRpcServer(RdmaBase& conn, uint32_t num_slots);
+    ~RdmaRpcServer();
+
+    /**
+     * Register a method with a raw handler.
+     * Should not be called while the workers are running.
+     * @param min_request_size Smaller requests are answered with `RPC_BAD_REQUEST`, without calling the handler.
+     */
+    void register_handler(uint16_t method, Handler handler, uint32_t min_request_size = 0);
+
+    /**
+     * Register a method with typed request and response.
+     * @param handler Of signature `void(const Request& request, Response& response)`.
+     * Both are directly in the RDMA buffers, without copy.
+     */
+    template<typename Request, typename Response, typename F>
+    void register_method(uint16_t method, F handler)
+    {
+        static_assert(std::is_trivially_copyable<Request>::value && std::is_trivially_copyable<Response>::value,
+                      "RPC types should be trivially copyable");
+        static_assert(alignof(Request) <= payload_alignment && alignof(Response) <= payload_alignment,
+                      "RPC types are over-aligned");
+
+        if(sizeof(Request) > max_payload_size() || sizeof(Response) > max_payload_size())
+        {
+            THROW_ERROR("register_method(): RPC types do not fit in a slot");
+        }
+
+        register_handler(method, [handler](const Buffer& request, const Buffer& response) -> uint32_t {
+            handler(*reinterpret_cast<const Request*>(request.data), *reinterpret_cast<Response*>(response.data));
+            return sizeof(Response);
+        }, sizeof(Request));
+    }
+
+    /**
+     * Process the completions and the requests already arrived, without blocking.
+     * With workers, the requests are handed to them instead of processed.
+     * @returns The number of requests processed, or handed to the workers.
+     * @note Rethrow the first error thrown by a worker.
+     */
+    int poll();
+
+    /**
+     * Wait for one request and process it, or hand it to the workers.
+     * Blocking.
+     */
+    void serve_one();
+
+    /**
+     * Run the handlers in `num_workers` threads.
+     * A slow handler then does not delay the other requests, and CPU-heavy handlers scale across cores.
+     * The handlers should be thread-safe. `poll()` or `serve_one()` should still be called to drain the completions,
+     * the workers only post.
+     */
+    void start_workers(size_t num_workers);
+
+    /**
+     * Wait for the workers to finish the requests already handed to them, and join them.
+     * Blocking. The handlers run again on the polling thread afterwards.
+     */
+    void stop_workers();
+
+protected:
+    void on_recv(uint32_t slot, uint32_t byte_len) override;
+
+private:
+    // A received request waiting for a worker
+    struct PendingRequest
+    {
+        uint32_t slot;
+        uint32_t byte_len;
+    };
+
+    // Call the handler of the request in the receiving slot `slot`, repost the slot and send the response
+    void handle_request(uint32_t slot, uint32_t byte_len, uint32_t response_slot_index);
+
+    // Process a completion inline, or hand it to the workers
+    void process(const ibv_wc& wc);
+
+    // Elements available in one of the worker queues, to let the idle workers sleep
+    struct Signal
+    {
+        // Pushed and not popped yet
+        std::atomic<size_t> count{0};
+        std::atomic<size_t> sleepers{0};
+        std::condition_variable cv;
+    };
+
+    // Count an element pushed to the queue of `signal`, and wake up a worker sleeping on it
+    void notify(Signal& signal);
+
+    // Wait until the queue of `signal` may have an element, or the workers are aborted (or stopped, if
+    // `until_stopping`). Spin a little first, then sleep.
+    void wait(Signal& signal, bool until_stopping);
+
+    // Wake up all the sleeping workers, to see `m_stopping` or `m_aborting`
+    void wake_all();
+
+    void worker_loop();
+    void rethrow_worker_error();
+
+    struct Method
+    {
+        Handler handler;
+        uint32_t min_request_size;
+    };
+
+    std::unordered_map<uint16_t, Method> m_handlers;
+    int m_num_processed = 0;
+
+    std::vector<std::thread> m_workers;
+
+    // Capacity of `num_slots()`, they can not be full: there is at most one request per receiving slot
+    std::unique_ptr<RdmaMpmcQueue<PendingRequest>> m_requests;
+    std::unique_ptr<RdmaMpmcQueue<uint32_t>> m_free_responses;
+
+    // Keep the repost of the receiving slot and the send of its response in order between the workers
+    std::mutex m_post_mutex;
+
+    std::mutex m_wake_mutex;
+    Signal m_request_signal;
+    Signal m_response_signal;
+
+    std::atomic<bool> m_stopping{false};
+    std::atomic<bool> m_aborting{false};
+    std::atomic<size_t> m_running_workers{0};
+
+    std::mutex m_error_mutex;
+    std::exception_ptr m_worker_error;
+};
+
+/**
+ * Client side of the RPC layer.
+ *
+ * Up to `num_slots()` requests can be in flight, and the responses can arrive in any order.
+ * The connection should be created with `RdmaOptions::prepost_receive` disabled,
+ * and should not be used for `msg_send`/`msg_recv` at the same time.
+ */
+class RdmaRpcClient : public RdmaRpcSlots
+{
+public:
+    /**
+     * Called when the response arrives.
+     * @param status See `RpcStatus`.
+     * @param response The payload of the response, in place in the receiving buffer.
+     * It is only valid during the call, and the handler should not wait for other responses.
+     */
+    using ResponseHandler = std::function<void(uint16_t status, const Buffer& response)>;
+
+    /**
+     * @param num_slots Number of requests in flight at most. Should be the same as the server one.
+     */
+    RdmaRpcClient(RdmaBase& conn, uint32_t num_slots);
+
+    /**
+     * Send a request without waiting for its response.
+     * Blocking only if there are already `num_slots()` requests in flight.
+     * @param fill Of signature `uint32_t(const Buffer& payload)`,
+     * writes the request in place in the sending slot and returns its size.
+     * @returns The request ID.
+     */
+    template<typename Fill>
+    uint32_t call_async(uint16_t method, Fill fill, ResponseHandler on_response)
+    {
+        const uint32_t slot = reserve();
+        const Buffer request = payload(send_slot(slot), max_payload_size());
+
+        return post_request(slot, method, fill(request), std::move(on_response));
+    }
+
+    /**
+     * Typed version of `call_async()`.
+     * @param fill Of signature `void(Request&)`, builds the request in place.
+     * @param on_response Of signature `void(uint16_t status, const Response&)`.
+     * When the status is not `RPC_OK`, the response is value-initialized and should be ignored.
+     */
+    template<typename Request, typename Response, typename Fill, typename OnResponse>
+    uint32_t call_async(uint16_t method, Fill fill, OnResponse on_response)
+    {
+        static_assert(std::is_trivially_copyable<Request>::value && std::is_trivially_copyable<Response>::value,
+                      "RPC types should be trivially copyable");
+        static_assert(alignof(Request) <= payload_alignment && alignof(Response) <= payload_alignment,
+                      "RPC types are over-aligned");
+
+        // Checked before `fill` writes the request, which would overflow into the next slot
+        if(sizeof(Request) > max_payload_size())
+        {
+            THROW_ERROR("call_async(): the RPC request type does not fit in a slot");
+        }
+
+        return call_async(method, [&fill](const Buffer& request) -> uint32_t {
+            fill(*reinterpret_cast<Request*>(request.data));
+            return sizeof(Request);
+        }, [on_response](uint16_t status, const Buffer& response) {
+            if(status != RPC_OK)
+            {
+                // The server did not write a response, do not read the slot
+                on_response(status, Response{});
+                return;
+            }
+
+            if(response.size < sizeof(Response))
+            {
+                throw helper_rdma::Error("RPC response is too small");
+            }
+
+            on_response(status, *reinterpret_cast<const Response*>(response.data));
+        });
+    }
+
+    /**
+     * Process the completions and the responses already arrived, without blocking.
+     * @returns The number of responses processed.
+     */
+    int poll();
+
+    /**
+     * Wait until the response of `request_id` is processed.
+     * Blocking. The other responses arriving meanwhile are processed too.
+     */
+    void wait(uint32_t request_id);
+
+    /**
+     * Wait until all the responses are processed.
+     * Blocking.
+     */
+    void wait_all();
+
+    /**
+     * @returns The number of requests waiting for their response.
+     */
+    size_t in_flight() const
+    {
+        return m_pending.size();
+    }
+
+protected:
+    void on_recv(uint32_t slot, uint32_t byte_len) override;
+
+private:
+    // Wait for a free sending slot and a free slot on the server
+    uint32_t reserve();
+
+    uint32_t post_request(uint32_t slot, uint16_t method, uint32_t size, ResponseHandler on_response);
+
+    std::unordered_map<uint32_t, ResponseHandler> m_pending;
+    uint32_t m_next_request_id = 0;
+    int m_num_processed = 0;
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "rdma_base.h"
+#include <deque>
+#include <functional>
+#include <unordered_map>
+
+/**
+ * Send scheduler with two priority classes, so bulk transfers do not delay latency-sensitive messages.
+ *
+ * Each peer is a connection with (at least) two QPs: a control QP and a bulk QP.
+ * - Control messages are posted at once on the control QP, they never wait behind bulk data.
+ * - Bulk writes are split into chunks, and only `max_bulk_in_flight` chunks are posted at a time over all the peers,
+ *   so the NIC has little bulk data queued ahead of a control message.
+ *   The peers share the chunks with deficit round robin, in proportion to their weight.
+ *
+ * Give the control QP a higher priority in the network with `RdmaOptions::type_of_service`.
+ * The scheduler polls the completions of the peers: the writes on their bulk QPs should go through it,
+ * and the other completions are forwarded to the handler set with `set_completion_handler()`.
+ */
+class RdmaSendScheduler
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Called for the completions that are not bulk writes (control sends, receives, writes on other QPs...).
+     * @param peer The index returned by `add_peer()`.
+     */
+    using CompletionHandler = std::function<void(size_t peer, const ibv_wc& wc)>;
+
+    /**
+     * @param chunk_size Size of the bulk chunks, which is also the longest a control message can wait on a QP.
+     * @param max_bulk_in_flight Number of bulk chunks posted at the same time, over all the peers.
+     */
+    explicit RdmaSendScheduler(uint32_t chunk_size = 256 * 1024, uint32_t max_bulk_in_flight = 4);
+
+    RdmaSendScheduler(const RdmaSendScheduler&) = delete;
+    RdmaSendScheduler& operator=(const RdmaSendScheduler&) = delete;
+
+    /**
+     * Add a connected peer.
+     * @param control_qp, bulk_qp Different QPs of the connection.
+     * @param weight Share of the bulk bandwidth relative to the other peers.
+     * @returns The index of the peer.
+     */
+    size_t add_peer(RdmaBase& conn, size_t control_qp = 0, size_t bulk_qp = 1, uint32_t weight = 1);
+
+    void set_completion_handler(CompletionHandler handler)
+    {
+        m_on_completion = std::move(handler);
+    }
+
+    /**
+     * Send a control message at once on the control QP of `peer`.
+     * Its completion is forwarded to the completion handler.
+     * @param buf Should point in the sending buffer of the connection.
+     */
+    void send_control(size_t peer, const Buffer& buf, uint64_t wr_id);
+
+    /**
+     * Queue a bulk write to `peer`, posted in chunks by `progress()`.
+     * @param local Should point in the sending buffer of the connection, or in a region from `register_memory()`.
+     * It should not be modified until the transfer is done.
+     * @param remote_addr, rkey The same fields as in `ibv_send_wr.rdma`.
+     * @returns The ID of the transfer.
+     */
+    uint64_t write_bulk(size_t peer, const Buffer& local, uint64_t remote_addr, uint32_t rkey);
+
+    /**
+     * Process the completions of all the peers, and post the next bulk chunks.
+     * Not blocking.
+     * @returns The number of bulk transfers completed.
+     */
+    int progress();
+
+    /**
+     * @returns true if all the chunks of the transfer are completed.
+     */
+    bool is_done(uint64_t transfer_id) const
+    {
+        return m_transfers.count(transfer_id) == 0;
+    }
+
+    /**
+     * Wait until a bulk transfer is completed.
+     * Blocking. The other peers and transfers make progress meanwhile.
+     */
+    void wait(uint64_t transfer_id);
+
+    /**
+     * Wait until all the bulk transfers are completed.
+     * Blocking.
+     */
+    void wait_all();
+
+private:
+    // Part of a bulk write not posted yet
+    struct PendingWrite
+    {
+        uint64_t transfer_id;
+        Buffer local;
+        uint64_t remote_addr;
+        uint32_t rkey;
+    };
+
+    struct Peer
+    {
+        RdmaBase* conn;
+        size_t control_qp;
+        size_t bulk_qp;
+
+        // Bytes added to the deficit each round, `chunk_size * weight`
+        uint64_t quantum;
+
+        // Bytes the peer can post in its current round
+        uint64_t deficit = 0;
+
+        std::deque<PendingWrite> pending;
+
+        // Transfer of each posted chunk, completions of a QP are in post order
+        std::deque<uint64_t> posted;
+    };
+
+    // Chunks of a transfer not completed yet, and whether they are all posted
+    struct Transfer
+    {
+        uint32_t chunks_in_flight = 0;
+        bool fully_posted = false;
+    };
+
+    // Post bulk chunks, deficit round robin over `m_active`
+    void schedule();
+
+    // Returns true if a bulk transfer is completed
+    bool process_completion(size_t peer_index, const ibv_wc& wc);
+
+    const uint32_t m_chunk_size;
+    const uint32_t m_max_bulk_in_flight;
+    uint32_t m_bulk_in_flight = 0;
+
+    std::vector<Peer> m_peers;
+
+    // Peers with pending bulk writes, the front one is being served
+    std::deque<size_t> m_active;
+
+    // The front peer got its quantum for its current round
+    bool m_front_credited = false;
+
+    std::unordered_map<uint64_t, Transfer> m_transfers;
+    uint64_t m_next_transfer_id = 0;
+
+    CompletionHandler m_on_completion;
+};
@@ -5,10 +5,24 @@
 class RdmaServer : public RdmaBase
 {
 public:
-    RdmaServer(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port);
+    /**
+     * @param options Queue sizes and QP attributes, see `RdmaOptions`.
+     * `RdmaOptions::num_qps` is ignored, the server accepts as many QPs as the client requests.
+     */
+    RdmaServer(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port,
+               const RdmaOptions& options = {});
     ~RdmaServer() override;
 
+    /**
+     * Set the data sent to the client when accepting its connection,
+     * for example the address and rkey of a region the client accesses with one-sided operations.
+     * The client gets it with `get_peer_private_data()`.
+     * Should be called before `wait_until_connected()`.
+     */
+    void set_private_data(const void* data, size_t size);
+
     void wait_until_connected() override;
+    void reconnect() override;
 
 protected:
     bool on_event_received(rdma_cm_event* const event) override;
@@ -16,4 +30,9 @@ protected:
     void on_conn_request(rdma_cm_id* const id);
     void on_conn_established(void* user_context);
     void on_disconnect(rdma_cm_id* const id);
+
+    // Index of the QP associated to `id`
+    size_t find_qp(rdma_cm_id* const id) const;
+
+    std::vector<uint8_t> m_private_data;
 };
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * One traced operation, or one run of a request handler.
+ * Times are in nanoseconds of `RdmaTracer::now()`.
+ */
+struct RdmaTraceEvent
+{
+    enum class Kind : uint8_t
+    {
+        /**
+         * A work request, from its post to its completion.
+         */
+        Operation,
+
+        /**
+         * A request handler, from its call to its return.
+         */
+        Handler
+    };
+
+    Kind kind;
+
+    /**
+     * True if `end_ns` comes from the completion timestamp of the NIC, false if it is the software poll time.
+     */
+    bool hw_timestamp;
+
+    /**
+     * The `ibv_wc_opcode` of the completion, for operations.
+     */
+    uint16_t opcode;
+
+    /**
+     * The QP number for operations, the index of the calling thread for handlers.
+     */
+    uint32_t track;
+
+    uint32_t byte_len;
+    uint64_t wr_id;
+
+    /**
+     * Post and completion for operations, call and return for handlers.
+     * `begin_ns` is 0 for an operation whose post was not traced.
+     */
+    uint64_t begin_ns;
+    uint64_t end_ns;
+
+    /**
+     * When the completion was polled, for operations.
+     * With hardware timestamps, `poll_ns - end_ns` is the delay between the NIC and the software.
+     */
+    uint64_t poll_ns;
+};
+
+/**
+ * Per-operation latency trace of a connection, to find where the latency outliers come from:
+ * the NIC and the network (post to completion), the polling (completion to poll), or the handler.
+ *
+ * The last `capacity` events are kept in a ring buffer, and can be dumped in the Chrome trace format
+ * (chrome://tracing or https://ui.perfetto.dev).
+ * Attach it with `RdmaBase::set_tracer()`, and enable `RdmaOptions::completion_timestamps` for hardware timestamps.
+ *
+ * Post times are matched to the completions by QP and `wr_id`. When several operations with the same `wr_id` are
+ * in flight on the same QP, only the last post is kept.
+ * Thread-safe, with a lock: tracing is meant for debugging and adds some latency by itself.
+ */
+class RdmaTracer
+{
+public:
+    /**
+     * @param capacity Number of events kept.
+     */
+    explicit RdmaTracer(size_t capacity = 1 << 16);
+
+    /**
+     * @returns The current time in nanoseconds, on the monotonic clock used by all the events.
+     */
+    static uint64_t now();
+
+    /**
+     * Record the post of a work request that generates a completion.
+     * @param recv Whether it is posted on the receive queue, which can use the same `wr_id` as the send queue.
+     */
+    void on_post(uint32_t qp_num, uint64_t wr_id, bool recv);
+
+    /**
+     * Record a successful completion.
+     * @param completion_ns When the operation completed, see `RdmaTraceEvent::end_ns`.
+     */
+    void on_completion(const ibv_wc& wc, uint64_t completion_ns, bool hw_timestamp, uint64_t poll_ns);
+
+    /**
+     * Record the run of a handler.
+     * @param wr_id The `wr_id` of the receive that carried the request.
+     */
+    void on_handler(uint64_t wr_id, uint64_t begin_ns, uint64_t end_ns);
+
+    /**
+     * @returns The events kept, oldest first.
+     */
+    std::vector<RdmaTraceEvent> events() const;
+
+    /**
+     * Forget all the events.
+     */
+    void clear();
+
+    /**
+     * Write the events in the Chrome trace event format (JSON).
+     * Operations are grouped by QP, and handlers by thread.
+     */
+    void dump_chrome_trace(std::ostream& out) const;
+
+    /**
+     * Same as above, in a file.
+     */
+    void dump_chrome_trace(const std::string& path) const;
+
+private:
+    void push(const RdmaTraceEvent& event);
+
+    mutable std::mutex m_mutex;
+
+    // Ring buffer, `m_next` is where the next event goes
+    std::vector<RdmaTraceEvent> m_events;
+    size_t m_next = 0;
+    bool m_full = false;
+
+    // Post times of the operations in flight of a QP, by `wr_id`
+    struct PostedOps
+    {
+        std::unordered_map<uint64_t, uint64_t> sends;
+        std::unordered_map<uint64_t, uint64_t> recvs;
+    };
+
+    // By QP number
+    std::unordered_map<uint32_t, PostedOps> m_posted;
+    size_t m_num_posted = 0;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "rdma_base.h"
+
+/**
+ * Remote access to a part of a buffer, granted to the peer for one request.
+ * The fields to send to the peer are `addr`, `rkey` and `size`.
+ */
+struct RdmaGrant
+{
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t size;
+
+    // The window bound to the buffer, and the QP it is bound on
+    ibv_mw* mw;
+    size_t qp_index;
+};
+
+/**
+ * Pool of type 2 memory windows, to give the peer access to a part of a buffer for the time of a request.
+ *
+ * `get_recv_rkey()` gives access to the whole receiving buffer for the lifetime of the connection,
+ * and registering a region per request is too slow for the hot path. Binding a window is a work request on the
+ * send queue, as cheap as a send, and invalidating it revokes the access of the peer.
+ *
+ * The buffers should be in regions registered with IBV_ACCESS_MW_BIND,
+ * for example with `RdmaOptions::recv_access`.
+ */
+class RdmaWindowPool
+{
+public:
+    using Buffer = RdmaBase::Buffer;
+
+    /**
+     * Allocate the windows.
+     * @param conn A connected connection.
+     * @param num_windows The number of grants that can be active at the same time.
+     */
+    RdmaWindowPool(RdmaBase& conn, size_t num_windows);
+    ~RdmaWindowPool();
+
+    RdmaWindowPool(const RdmaWindowPool&) = delete;
+    RdmaWindowPool& operator=(const RdmaWindowPool&) = delete;
+
+    /**
+     * Give the peer access to `buf`.
+     * Not blocking: the bind is posted on the send queue, and the rkey can be sent in the next message.
+     * @param access IBV_ACCESS_REMOTE_READ and/or IBV_ACCESS_REMOTE_WRITE.
+     * @param qp_index The QP the peer should use to access the buffer.
+     * @note Throw an error if no window can be granted on this QP.
+     */
+    RdmaGrant grant(const Buffer& buf, int access = IBV_ACCESS_REMOTE_WRITE, size_t qp_index = 0);
+
+    /**
+     * Revoke a grant: the peer can not use its rkey anymore, and its window goes back to the pool.
+     * Not blocking: the invalidation is posted on the QP of the grant, and the operations posted after it
+     * on this QP are done after the invalidation.
+     * The window is only granted again on the same QP, so its next bind is ordered after the invalidation.
+     */
+    void revoke(const RdmaGrant& grant);
+
+    /**
+     * @returns The number of windows that can be granted on the QP `qp_index`.
+     */
+    size_t available(size_t qp_index = 0) const;
+
+private:
+    // Marks a window never bound, it can be granted on any QP
+    static constexpr size_t unbound = SIZE_MAX;
+
+    struct FreeWindow
+    {
+        ibv_mw* mw;
+
+        // The QP it was last bound on, or `unbound`
+        size_t qp_index;
+    };
+
+    RdmaBase& m_conn;
+
+    std::vector<ibv_mw*> m_windows;
+    std::vector<FreeWindow> m_free;
+};
@@ -36,18 +36,29 @@ int main(int argc, char *argv[])
 {
     HENSURE(argc >= 4);
 
-    // Get cmd arguments <-c|-s> <address> <port> <buf_size> <num_trials> of the server
+    // Get cmd arguments <-c|-s> <address> <port> <buf_size> <num_trials> <trace_file> of the server
     const std::string addr = argv[2];
     const int port = atoi(argv[3]);
 
     const uint32_t buf_size = (argc < 5 ? 4'000'000 : static_cast<uint32_t>(atoi(argv[4])));
     const int num_trials = (argc < 6 ? 1'000 : atoi(argv[5]));
+    const std::string trace_file = (argc < 7 ? "" : argv[6]);
+
+    RdmaOptions options;
+    options.completion_timestamps = !trace_file.empty();
+
+    RdmaTracer tracer;
 
     Timer conn_timer;
 
     if(strcmp(argv[1], "-s") == 0)
     {
-        RdmaServer server(buf_size, buf_size, addr, port);
+        RdmaServer server(buf_size, buf_size, addr, port, options);
+        if(!trace_file.empty())
+        {
+            server.set_tracer(&tracer);
+        }
+
         server.wait_until_connected();
         conn_timer.reset();
         
@@ -62,7 +73,12 @@ int main(int argc, char *argv[])
     }
     else if(strcmp(argv[1], "-c") == 0)
     {
-        RdmaClient client(buf_size, buf_size, addr, port);
+        RdmaClient client(buf_size, buf_size, addr, port, "", options);
+        if(!trace_file.empty())
+        {
+            client.set_tracer(&tracer);
+        }
+
         client.wait_until_connected();
         conn_timer.reset();
         
@@ -81,6 +97,12 @@ int main(int argc, char *argv[])
     const double gbits_per_sec = (static_cast<double>(bytes_sent) / conn_timer.elapsed()) / 1e9 * CHAR_BIT;
     printf("Bandwidth: %f Gbit/s\n", gbits_per_sec);
 
+    if(!trace_file.empty())
+    {
+        tracer.dump_chrome_trace(trace_file);
+        printf("Trace written to %s\n", trace_file.c_str());
+    }
+
 
     puts("exit");
     return EXIT_SUCCESS;
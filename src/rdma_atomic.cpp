@@ -0,0 +1,100 @@
+#include "rdma_atomic.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace
+{
+
+void check_scratch(const RdmaBase::Buffer& scratch)
+{
+    if(scratch.size < sizeof(uint64_t) || reinterpret_cast<uintptr_t>(scratch.data) % sizeof(uint64_t) != 0)
+    {
+        THROW_ERROR("The scratch buffer of atomics should be 8 bytes, 8 bytes aligned");
+    }
+}
+
+uint64_t load_scratch(const RdmaBase::Buffer& scratch)
+{
+    uint64_t value;
+    std::memcpy(&value, scratch.data, sizeof(value));
+    return value;
+}
+
+}
+
+RdmaRemoteCounter::RdmaRemoteCounter(RdmaBase& conn, const Buffer& scratch, uint64_t remote_addr, uint32_t rkey)
+    : m_conn(conn),
+      m_scratch(scratch),
+      m_remote_addr(remote_addr),
+      m_rkey(rkey)
+{
+    check_scratch(scratch);
+}
+
+uint64_t RdmaRemoteCounter::fetch_add(uint64_t value)
+{
+    m_conn.post_fetch_add(m_scratch, m_remote_addr, m_rkey, value);
+    m_conn.wait_for_atomic();
+
+    return load_scratch(m_scratch);
+}
+
+uint64_t RdmaRemoteCounter::load()
+{
+    // Adding 0 reads the word atomically with respect to the other atomics
+    return fetch_add(0);
+}
+
+RdmaRemoteLock::RdmaRemoteLock(RdmaBase& conn, const Buffer& scratch, uint64_t remote_addr, uint32_t rkey,
+                               uint64_t owner_id)
+    : m_conn(conn),
+      m_scratch(scratch),
+      m_remote_addr(remote_addr),
+      m_rkey(rkey),
+      m_owner_id(owner_id)
+{
+    check_scratch(scratch);
+
+    if(owner_id == 0)
+    {
+        THROW_ERROR("The owner ID of a remote lock can not be 0");
+    }
+}
+
+uint64_t RdmaRemoteLock::cmp_swap(uint64_t compare, uint64_t swap)
+{
+    m_conn.post_cmp_swap(m_scratch, m_remote_addr, m_rkey, compare, swap);
+    m_conn.wait_for_atomic();
+
+    return load_scratch(m_scratch);
+}
+
+bool RdmaRemoteLock::try_lock()
+{
+    return cmp_swap(0, m_owner_id) == 0;
+}
+
+void RdmaRemoteLock::lock()
+{
+    // One atomic is a round trip, do not spin faster than that on a contended lock
+    std::chrono::microseconds backoff(1);
+    const std::chrono::microseconds max_backoff(1'000);
+
+    while(!try_lock())
+    {
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, max_backoff);
+    }
+}
+
+void RdmaRemoteLock::unlock()
+{
+    // A compare and swap rather than a write, because writes are not atomic with respect to atomics on all NICs
+    const uint64_t previous = cmp_swap(m_owner_id, 0);
+
+    if(previous != m_owner_id)
+    {
+        THROW_ERROR("Unlocking a remote lock owned by %llu", static_cast<unsigned long long>(previous));
+    }
+}
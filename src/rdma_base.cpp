@@ -1,17 +1,56 @@
 #include "rdma_base.h"
-#include <cassert>
+#include "spdlog/spdlog.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+
+// How many empty polls of the CQ before checking if the peer disconnected
+const int disconnect_check_interval = 1 << 16;
+
+std::string wc_error_string(const ibv_wc& wc)
+{
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Failed status %s (%d) for wr_id %d",
+             ibv_wc_status_str(wc.status),
+             wc.status,
+             (int) wc.wr_id);
+    return msg;
+}
+
+}
+
+helper_rdma::WcError::WcError(const ibv_wc& wc)
+    : Error(wc_error_string(wc)),
+      m_wc(wc)
+{
+}
 
-RdmaBase::RdmaBase(uint32_t send_buf_sz, uint32_t recv_buf_sz)
-    : m_send_buf(send_buf_sz),
+RdmaBase::RdmaBase(uint32_t send_buf_sz, uint32_t recv_buf_sz, const RdmaOptions& options)
+    : m_options(options),
+      m_send_buf(send_buf_sz),
       m_recv_buf(recv_buf_sz)
 {
+    if(m_options.num_qps == 0 || m_options.num_qps > UINT16_MAX)
+    {
+        THROW_ERROR("Invalid number of QPs %u", m_options.num_qps);
+    }
+
     // Create RDMA communication manager event channel
     m_event_channel = rdma_create_event_channel();
-    HENSURE_ERRNO(m_event_channel != nullptr);
+    HTHROW_ERRNO(m_event_channel != nullptr);
+
+    // Signaled by `interrupt_cm_wait()`
+    m_interrupt_fd = eventfd(0, EFD_CLOEXEC);
+    HTHROW_ERRNO(m_interrupt_fd >= 0);
 
     // Create RDMA communication manager ID
     // RDMA_PS_TCP == RC QP (Reliable Connection Queue Pair, like TCP)
-    HENSURE_ERRNO(rdma_create_id(m_event_channel, &m_connection_id, nullptr, RDMA_PS_TCP) == 0);
+    HTHROW_ERRNO(rdma_create_id(m_event_channel, &m_connection_id, nullptr, RDMA_PS_TCP) == 0);
 }
 
 RdmaBase::~RdmaBase()
@@ -31,6 +70,18 @@ RdmaBase::~RdmaBase()
         m_event_channel = nullptr;
     }
 
+    if(m_interrupt_fd >= 0)
+    {
+        HENSURE_ERRNO(close(m_interrupt_fd) == 0);
+        m_interrupt_fd = -1;
+    }
+
+    for(ibv_mr* mr : m_extra_mrs)
+    {
+        HENSURE_ERRNO(ibv_dereg_mr(mr) == 0);
+    }
+    m_extra_mrs.clear();
+
     if(m_send_mr)
     {
         HENSURE_ERRNO(ibv_dereg_mr(m_send_mr) == 0);
@@ -56,10 +107,83 @@ RdmaBase::Buffer RdmaBase::get_recv_buf()
 {
     return {
         .data = m_recv_buf.data(),
-        .size = static_cast<uint32_t>(m_send_buf.size())
+        .size = static_cast<uint32_t>(m_recv_buf.size())
     };
 }
 
+ibv_mr* RdmaBase::register_memory(void* addr, size_t size, int access)
+{
+    if(!m_pd)
+    {
+        THROW_ERROR("register_memory(): no context yet, connect first");
+    }
+
+    ibv_mr* const mr = ibv_reg_mr(m_pd, addr, size, access);
+    HTHROW_ERRNO(mr != nullptr);
+
+    m_extra_mrs.push_back(mr);
+    return mr;
+}
+
+void RdmaBase::deregister_memory(ibv_mr* mr)
+{
+    const auto it = std::find(m_extra_mrs.begin(), m_extra_mrs.end(), mr);
+    if(it == m_extra_mrs.end())
+    {
+        THROW_ERROR("deregister_memory(): unknown memory region");
+    }
+
+    m_extra_mrs.erase(it);
+    HTHROW_ERRNO(ibv_dereg_mr(mr) == 0);
+}
+
+bool RdmaBase::supports_on_demand_paging(uint32_t rc_ops)
+{
+    if(!m_context)
+    {
+        THROW_ERROR("supports_on_demand_paging(): no context yet, connect first");
+    }
+
+    ibv_device_attr_ex attr{};
+    HTHROW_RET(ibv_query_device_ex(m_context, nullptr, &attr));
+
+    return (attr.odp_caps.general_caps & IBV_ODP_SUPPORT)
+           && (attr.odp_caps.per_transport_caps.rc_odp_caps & rc_ops) == rc_ops;
+}
+
+ibv_mw* RdmaBase::alloc_window()
+{
+    if(!m_pd)
+    {
+        THROW_ERROR("alloc_window(): no context yet, connect first");
+    }
+
+    if(!(m_device_cap_flags & IBV_DEVICE_MEM_WINDOW_TYPE_2B))
+    {
+        THROW_ERROR("alloc_window(): the device does not support type 2 memory windows");
+    }
+
+    ibv_mw* const mw = ibv_alloc_mw(m_pd, IBV_MW_TYPE_2);
+    HTHROW_ERRNO(mw != nullptr);
+
+    return mw;
+}
+
+void RdmaBase::dealloc_window(ibv_mw* mw)
+{
+    HTHROW_RET(ibv_dealloc_mw(mw));
+}
+
+ibv_pd* RdmaBase::get_protection_domain()
+{
+    if(!m_pd)
+    {
+        THROW_ERROR("get_protection_domain(): no context yet, connect first");
+    }
+
+    return m_pd;
+}
+
 uint32_t RdmaBase::get_recv_rkey()
 {
     return m_recv_mr->rkey;
@@ -71,7 +195,7 @@ void RdmaBase::wait_for_send()
 
     if(wc.opcode != IBV_WC_SEND)
     {
-        FATAL_ERROR("Expected IBV_WC_SEND event, got something different.");
+        THROW_ERROR("Expected IBV_WC_SEND event, got something different.");
     }
 }
 
@@ -95,13 +219,13 @@ void RdmaBase::wait_for_1send_1recv(uint32_t& size)
         }
         else
         {
-            FATAL_ERROR("Expected IBV_WC_SEND or IBV_WC_RECV event, got something different.");
+            THROW_ERROR("Expected IBV_WC_SEND or IBV_WC_RECV event, got something different.");
         }
     }
 
     if(send_count != 1 || recv_count != 1)
     {
-        FATAL_ERROR("Expected exactly 1 send and 1 recv, got %d sends and %d receives", send_count, recv_count);
+        THROW_ERROR("Expected exactly 1 send and 1 recv, got %d sends and %d receives", send_count, recv_count);
     }
 }
 
@@ -112,19 +236,40 @@ void RdmaBase::wait_for_recv(uint32_t& size)
 
     if(!(wc.opcode & IBV_WC_RECV))
     {
-        FATAL_ERROR("Next event should be IBV_WC_RECV");
+        THROW_ERROR("Next event should be IBV_WC_RECV");
     }
 
     // `ibv_wc.byte_len` stores the actual data received
     size = wc.byte_len;
 }
 
-void RdmaBase::wait_for_recv_payload(uint32_t& size, uint32_t& payload)
+void RdmaBase::wait_for_read()
 {
     const ibv_wc wc = wait_event();
 
+    if(wc.opcode != IBV_WC_RDMA_READ)
+    {
+        THROW_ERROR("Expected IBV_WC_RDMA_READ event, got something different.");
+    }
+}
+
+void RdmaBase::wait_for_atomic()
+{
+    const ibv_wc wc = wait_event();
+
+    if(wc.opcode != IBV_WC_FETCH_ADD && wc.opcode != IBV_WC_COMP_SWAP)
+    {
+        THROW_ERROR("Expected IBV_WC_FETCH_ADD or IBV_WC_COMP_SWAP event, got something different.");
+    }
+}
+
+void RdmaBase::wait_for_recv_payload(uint32_t& size, uint32_t& payload)
+{
+    ibv_wc wc = wait_event();
+
     while(!(wc.opcode & IBV_WC_RECV) || !(wc.wc_flags & IBV_WC_WITH_IMM))
     {
+        wc = wait_event();
     }
 
     // `ibv_wc.byte_len` stores the actual data received
@@ -134,13 +279,64 @@ void RdmaBase::wait_for_recv_payload(uint32_t& size, uint32_t& payload)
 
 rdma_cm_event RdmaBase::wait_cm_event()
 {
+    CmEvent event;
+
+    if(!m_deferred_cm_events.empty())
+    {
+        event = std::move(m_deferred_cm_events.front());
+        m_deferred_cm_events.pop_front();
+    }
+    else
+    {
+        event = get_cm_event();
+    }
+
+    m_event_private_data = std::move(event.private_data);
+    m_event_conn_param = event.event.param.conn;
+
+    return event.event;
+}
+
+void RdmaBase::interrupt_cm_wait()
+{
+    const uint64_t one = 1;
+    HTHROW_ERRNO(write(m_interrupt_fd, &one, sizeof(one)) == sizeof(one));
+}
+
+RdmaBase::CmEvent RdmaBase::get_cm_event()
+{
+    // Wait for an event or an interruption, `rdma_get_cm_event()` itself can not be interrupted
+    pollfd fds[2]{};
+    fds[0].fd = m_event_channel->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_interrupt_fd;
+    fds[1].events = POLLIN;
+
+    while(poll(fds, 2, -1) < 0)
+    {
+        HTHROW_ERRNO(errno == EINTR);
+    }
+
+    if(fds[1].revents & POLLIN)
+    {
+        uint64_t count;
+        HTHROW_ERRNO(read(m_interrupt_fd, &count, sizeof(count)) == sizeof(count));
+        THROW_ERROR("Waiting for an RDMA connection manager event was interrupted");
+    }
+
     rdma_cm_event* event = nullptr;
-    HENSURE_ERRNO(rdma_get_cm_event(m_event_channel, &event) == 0);
+    HTHROW_ERRNO(rdma_get_cm_event(m_event_channel, &event) == 0);
 
     // The event needs to be copied because acknowledging the event frees it
-    rdma_cm_event copy = *event;
+    CmEvent copy;
+    copy.event = *event;
+
+    const auto* private_data = static_cast<const uint8_t*>(event->param.conn.private_data);
+    copy.private_data.assign(private_data, private_data + (private_data ? event->param.conn.private_data_len : 0));
+    copy.event.param.conn.private_data = nullptr;
+    copy.event.param.conn.private_data_len = 0;
 
-    HENSURE_ERRNO(rdma_ack_cm_event(event) == 0);
+    HTHROW_ERRNO(rdma_ack_cm_event(event) == 0);
 
     return copy;
 }
@@ -154,30 +350,263 @@ ibv_wc RdmaBase::wait_event()
     // `ibv_poll_cq` is non-blocking
     // This will loop until one event is popped
     // 100% CPU usage!
-    while(true)
+    int empty_polls = 0;
+    while(!poll_event(ret))
+    {
+        // A peer that went away does not always generate a CQE on our side
+        if(++empty_polls == disconnect_check_interval)
+        {
+            empty_polls = 0;
+            check_disconnected();
+        }
+    }
+
+    return ret;
+}
+
+bool RdmaBase::poll_event(ibv_wc& wc)
+{
+    uint64_t timestamp = 0;
+
+    if(!poll_cq(wc, timestamp))
     {
-        const int num_completions = ibv_poll_cq(m_cq, 1, &ret);
-        HENSURE_ERRNO(num_completions >= 0);
+        return false;
+    }
+
+    if(wc.status != IBV_WC_SUCCESS)
+    {
+        throw helper_rdma::WcError(wc);
+    }
 
-        if(num_completions == 0)
+    if(m_tracer)
+    {
+        const uint64_t poll_ns = RdmaTracer::now();
+
+        if(m_cq_ex)
         {
-            continue;
+            m_tracer->on_completion(wc, hardware_to_host_ns(timestamp, poll_ns), true, poll_ns);
         }
         else
         {
-            if(ret.status != IBV_WC_SUCCESS)
-            {
-                FATAL_ERROR("Failed status %s (%d) for wr_id %d\n",
-                            ibv_wc_status_str(ret.status),
-                            ret.status,
-                            (int) ret.wr_id);
-            }
+            m_tracer->on_completion(wc, poll_ns, false, poll_ns);
+        }
+    }
+
+    return true;
+}
+
+bool RdmaBase::poll_cq(ibv_wc& wc, uint64_t& timestamp)
+{
+    if(!m_cq_ex)
+    {
+        const int num_completions = ibv_poll_cq(m_cq, 1, &wc);
+        HTHROW_ERRNO(num_completions >= 0);
+
+        return num_completions > 0;
+    }
+
+    ibv_poll_cq_attr attr{};
+    const int ret = ibv_start_poll(m_cq_ex, &attr);
+
+    if(ret == ENOENT)
+    {
+        return false;
+    }
+    HTHROW_RET(ret);
+
+    wc = ibv_wc{};
+    wc.wr_id = m_cq_ex->wr_id;
+    wc.status = m_cq_ex->status;
+    wc.vendor_err = ibv_wc_read_vendor_err(m_cq_ex);
 
-            break;
+    // The other fields are only valid for successful completions
+    if(wc.status == IBV_WC_SUCCESS)
+    {
+        wc.opcode = ibv_wc_read_opcode(m_cq_ex);
+        wc.byte_len = ibv_wc_read_byte_len(m_cq_ex);
+        wc.qp_num = ibv_wc_read_qp_num(m_cq_ex);
+        wc.src_qp = ibv_wc_read_src_qp(m_cq_ex);
+        wc.wc_flags = ibv_wc_read_wc_flags(m_cq_ex);
+
+        if(wc.wc_flags & IBV_WC_WITH_IMM)
+        {
+            wc.imm_data = ibv_wc_read_imm_data(m_cq_ex);
         }
+
+        timestamp = ibv_wc_read_completion_ts(m_cq_ex);
     }
 
-    return ret;
+    ibv_end_poll(m_cq_ex);
+    return true;
+}
+
+uint64_t RdmaBase::hardware_to_host_ns(uint64_t timestamp, uint64_t poll_ns)
+{
+    // Split to not overflow
+    const uint64_t hw_ns = timestamp / m_hca_core_clock * 1'000'000
+                           + timestamp % m_hca_core_clock * 1'000'000 / m_hca_core_clock;
+
+    // The completion is before its poll, so the smallest gap is the closest to the real offset
+    const int64_t offset = static_cast<int64_t>(poll_ns - hw_ns);
+
+    if(poll_ns >= m_clock_window_end_ns)
+    {
+        m_clock_offset_ns = m_next_clock_offset_ns;
+        m_next_clock_offset_ns = offset;
+        m_clock_window_end_ns = poll_ns + 1'000'000'000;
+    }
+    else
+    {
+        m_next_clock_offset_ns = std::min(m_next_clock_offset_ns, offset);
+    }
+
+    return hw_ns + static_cast<uint64_t>(std::min(m_clock_offset_ns, m_next_clock_offset_ns));
+}
+
+bool RdmaBase::is_qp_error()
+{
+    if(m_qps.empty())
+    {
+        return true;
+    }
+
+    for(const QueuePair& qp : m_qps)
+    {
+        if(!qp.qp)
+        {
+            return true;
+        }
+
+        ibv_qp_attr attr{};
+        ibv_qp_init_attr init_attr{};
+        HTHROW_RET(ibv_query_qp(qp.qp, &attr, IBV_QP_STATE, &init_attr));
+
+        if(attr.qp_state == IBV_QPS_ERR || attr.qp_state == IBV_QPS_SQE)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t RdmaBase::select_qp(uint64_t key)
+{
+    switch(m_ordering)
+    {
+        case Ordering::Strict:
+            return 0;
+
+        case Ordering::PerKey:
+            // Fibonacci hashing, so that consecutive keys are spread
+            return static_cast<size_t>(((key * 0x9E3779B97F4A7C15ull) >> 32) % m_qps.size());
+
+        case Ordering::Relaxed:
+            return m_next_qp++ % m_qps.size();
+    }
+
+    return 0;
+}
+
+ibv_qp* RdmaBase::get_qp(size_t qp_index)
+{
+    if(qp_index >= m_qps.size() || !m_qps[qp_index].qp)
+    {
+        THROW_ERROR("QP %zu is not connected", qp_index);
+    }
+
+    return m_qps[qp_index].qp;
+}
+
+void RdmaBase::check_disconnected()
+{
+    pollfd fd{};
+    fd.fd = m_event_channel->fd;
+    fd.events = POLLIN;
+
+    // Only consume an event if one is pending, to not block
+    while(poll(&fd, 1, 0) > 0)
+    {
+        CmEvent event = get_cm_event();
+
+        if(event.event.event == RDMA_CM_EVENT_DISCONNECTED || event.event.event == RDMA_CM_EVENT_DEVICE_REMOVAL)
+        {
+            THROW_ERROR("Peer disconnected: %s", rdma_event_str(event.event.event));
+        }
+
+        // Not ours (e.g. a connection request on the server), `wait_cm_event()` returns it later
+        m_deferred_cm_events.push_back(std::move(event));
+    }
+}
+
+void RdmaBase::destroy_qp()
+{
+    for(QueuePair& qp : m_qps)
+    {
+        if(!qp.id)
+        {
+            continue;
+        }
+
+        if(qp.qp)
+        {
+            // Best effort, the peer may be already gone
+            rdma_disconnect(qp.id);
+
+            rdma_destroy_qp(qp.id);
+        }
+
+        if(rdma_destroy_id(qp.id) != 0)
+        {
+            spdlog::warn("rdma_destroy_id() failed: {}", strerror(errno));
+        }
+
+        if(m_connection_id == qp.id)
+        {
+            m_connection_id = nullptr;
+        }
+    }
+
+    m_qps.clear();
+
+    // Discard the flushed work completions
+    if(m_cq)
+    {
+        ibv_wc wc{};
+        uint64_t timestamp;
+        while(poll_cq(wc, timestamp))
+        {
+        }
+    }
+}
+
+void RdmaBase::reconnect_after_error(const helper_rdma::Error& e, int& attempt)
+{
+    spdlog::warn("RDMA operation failed: {}", e.what());
+
+    while(true)
+    {
+        // Exponential backoff, capped to one second, to let a restarting peer come back
+        const int backoff_ms = std::min(1'000, 10 << std::min(attempt, 10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+
+        spdlog::info("Reconnecting (attempt {}/{})", attempt + 1, m_max_reconnects);
+
+        try
+        {
+            reconnect();
+            return;
+        }
+        catch(const helper_rdma::Error& reconnect_error)
+        {
+            spdlog::warn("Reconnection failed: {}", reconnect_error.what());
+
+            if(++attempt >= m_max_reconnects)
+            {
+                throw;
+            }
+        }
+    }
 }
 
 void RdmaBase::setup_context(ibv_context* const context)
@@ -187,7 +616,7 @@ void RdmaBase::setup_context(ibv_context* const context)
     {
         if(m_context != context)
         {
-            FATAL_ERROR("Can't handle more than one context");
+            THROW_ERROR("Can't handle more than one context");
         }
 
         return;
@@ -195,29 +624,49 @@ void RdmaBase::setup_context(ibv_context* const context)
 
     m_context = context;
 
+    ibv_device_attr device_attr{};
+    HTHROW_RET(ibv_query_device(context, &device_attr));
+    validate_options(device_attr);
+    m_device_cap_flags = device_attr.device_cap_flags;
+
     m_pd = ibv_alloc_pd(context);
-    HENSURE_ERRNO(m_pd != nullptr);
+    HTHROW_ERRNO(m_pd != nullptr);
 
     m_comp_channel = ibv_create_comp_channel(context);
-    HENSURE_ERRNO(m_comp_channel != nullptr);
+    HTHROW_ERRNO(m_comp_channel != nullptr);
+
+    if(m_options.completion_timestamps)
+    {
+        create_timestamped_cq(context);
+    }
 
-    const int cq_size = 1'000;
-    m_cq = ibv_create_cq(context, cq_size, nullptr, m_comp_channel, 0);
-    HENSURE_ERRNO(m_cq != nullptr);
+    if(!m_cq)
+    {
+        m_cq = ibv_create_cq(context, static_cast<int>(m_options.cq_size), nullptr, m_comp_channel, 0);
+        HTHROW_ERRNO(m_cq != nullptr);
+    }
 
-    HENSURE_ERRNO(ibv_req_notify_cq(m_cq, 0) == 0);
+    HTHROW_RET(ibv_req_notify_cq(m_cq, 0));
 
     // Register memory region
-    const int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+    m_send_mr = ibv_reg_mr(m_pd, m_send_buf.data(), m_send_buf.size(), m_options.send_access);
+    HTHROW_ERRNO(m_send_mr != nullptr);
+
+    m_recv_mr = ibv_reg_mr(m_pd, m_recv_buf.data(), m_recv_buf.size(), m_options.recv_access);
+    HTHROW_ERRNO(m_recv_mr != nullptr);
+}
 
-    m_send_mr = ibv_reg_mr(m_pd, m_send_buf.data(), m_send_buf.size(), access);
-    HENSURE_ERRNO(m_send_mr != nullptr);
+void RdmaBase::post_receive(size_t qp_index)
+{
+    post_receive(get_recv_buf(), 123, qp_index); // Arbitrary wr_id
+}
 
-    m_recv_mr = ibv_reg_mr(m_pd, m_recv_buf.data(), m_recv_buf.size(), access);
-    HENSURE_ERRNO(m_recv_mr != nullptr);
+void RdmaBase::post_receive(const Buffer& recv_buf, uint64_t wr_id, size_t qp_index)
+{
+    post_receive_lkey(recv_buf, m_recv_mr->lkey, wr_id, qp_index);
 }
 
-void RdmaBase::post_receive()
+void RdmaBase::post_receive_lkey(const Buffer& recv_buf, uint32_t lkey, uint64_t wr_id, size_t qp_index)
 {
     ibv_recv_wr wr;
     ibv_recv_wr* bad_wr = nullptr;
@@ -225,26 +674,40 @@ void RdmaBase::post_receive()
 
     // Only 1 scatter/gather entry (SGE)
 
-    wr.wr_id = 123; // Arbitrary
+    wr.wr_id = wr_id;
     wr.next = nullptr;
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = reinterpret_cast<uintptr_t>(m_recv_buf.data());
-    sge.length = m_recv_buf.size();
-    sge.lkey = m_recv_mr->lkey;
+    sge.addr = reinterpret_cast<uintptr_t>(recv_buf.data);
+    sge.length = recv_buf.size;
+    sge.lkey = lkey;
 
-    assert(m_qp != nullptr);
-    HENSURE_ERRNO(ibv_post_recv(m_qp, &wr, &bad_wr) == 0);
+    ibv_qp* const qp = get_qp(qp_index);
+
+    if(m_tracer)
+    {
+        m_tracer->on_post(qp->qp_num, wr_id, true);
+    }
+
+    HTHROW_RET(ibv_post_recv(qp, &wr, &bad_wr));
+}
+
+void RdmaBase::post_send(uint32_t size, bool cqe_event, size_t qp_index)
+{
+    post_send(Buffer{m_send_buf.data(), size}, 123, cqe_event, qp_index); // Arbitrary wr_id
 }
 
-void RdmaBase::post_send(uint32_t size, bool cqe_event)
+void RdmaBase::post_send(const Buffer& send_buf, uint64_t wr_id, bool cqe_event, size_t qp_index)
+{
+    post_send_lkey(send_buf, m_send_mr->lkey, wr_id, cqe_event, qp_index);
+}
+
+void RdmaBase::post_send_lkey(const Buffer& send_buf, uint32_t lkey, uint64_t wr_id, bool cqe_event, size_t qp_index)
 {
     ibv_send_wr wr;
     memset(&wr, 0, sizeof(wr));
 
-    ibv_send_wr* bad_wr = nullptr;
-
     ibv_sge sge;
     memset(&sge, 0, sizeof(sge));
 
@@ -257,32 +720,36 @@ void RdmaBase::post_send(uint32_t size, bool cqe_event)
         wr.send_flags = IBV_SEND_SIGNALED;
     }
     
-    wr.wr_id = 123; // Arbitrary
+    wr.wr_id = wr_id;
     wr.next = nullptr;
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = reinterpret_cast<uintptr_t>(m_send_buf.data());
-    sge.length = size;
-    sge.lkey = m_send_mr->lkey;
+    sge.addr = reinterpret_cast<uintptr_t>(send_buf.data);
+    sge.length = send_buf.size;
+    sge.lkey = lkey;
 
-    assert(m_qp != nullptr);
-    HENSURE_ERRNO(ibv_post_send(m_qp, &wr, &bad_wr) == 0);
+    post_send_wr(wr, qp_index);
 }
 
-void RdmaBase::post_write(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey)
+void RdmaBase::post_write(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, bool cqe_event,
+                          size_t qp_index)
 {
     ibv_send_wr wr;
     memset(&wr, 0, sizeof(wr));
 
-    ibv_send_wr* bad_wr = nullptr;
-
     ibv_sge sge;
     memset(&sge, 0, sizeof(sge));
 
     // Only 1 scatter/gather entry (SGE)
 
     wr.opcode = IBV_WR_RDMA_WRITE;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
     wr.wr_id = 123; // Arbitrary
     wr.next = nullptr;
     wr.sg_list = &sge;
@@ -293,25 +760,29 @@ void RdmaBase::post_write(const Buffer& send_buf, uint64_t remote_addr, uint32_t
 
     sge.addr = reinterpret_cast<uintptr_t>(send_buf.data);
     sge.length = send_buf.size;
-    sge.lkey = m_send_mr->lkey;
+    sge.lkey = get_lkey(send_buf);
 
-    assert(m_qp != nullptr);
-    HENSURE_ERRNO(ibv_post_send(m_qp, &wr, &bad_wr) == 0);
+    post_send_wr(wr, qp_index);
 }
 
-void RdmaBase::post_write_imm(const RdmaBase::Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload)
+void RdmaBase::post_write_imm(const RdmaBase::Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload,
+                              bool cqe_event, size_t qp_index)
 {
     ibv_send_wr wr;
     memset(&wr, 0, sizeof(wr));
 
-    ibv_send_wr* bad_wr = nullptr;
-
     ibv_sge sge;
     memset(&sge, 0, sizeof(sge));
 
     // Only 1 scatter/gather entry (SGE)
 
     wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
     wr.wr_id = 123; // Arbitrary
     wr.next = nullptr;
     wr.sg_list = &sge;
@@ -323,13 +794,290 @@ void RdmaBase::post_write_imm(const RdmaBase::Buffer& send_buf, uint64_t remote_
 
     sge.addr = reinterpret_cast<uintptr_t>(send_buf.data);
     sge.length = send_buf.size;
-    sge.lkey = m_send_mr->lkey;
+    sge.lkey = get_lkey(send_buf);
 
-    assert(m_qp != nullptr);
-    HENSURE_ERRNO(ibv_post_send(m_qp, &wr, &bad_wr) == 0);
+    post_send_wr(wr, qp_index);
 }
 
-void RdmaBase::build_qp_init_attr(ibv_cq* const cq, ibv_qp_init_attr* qp_attr)
+void RdmaBase::post_read(const Buffer& local_buf, uint64_t remote_addr, uint32_t rkey, bool cqe_event,
+                         size_t qp_index)
+{
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+
+    ibv_sge sge;
+    memset(&sge, 0, sizeof(sge));
+
+    // Only 1 scatter/gather entry (SGE)
+
+    wr.opcode = IBV_WR_RDMA_READ;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
+    wr.wr_id = 123; // Arbitrary
+    wr.next = nullptr;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+
+    sge.addr = reinterpret_cast<uintptr_t>(local_buf.data);
+    sge.length = local_buf.size;
+    sge.lkey = get_lkey(local_buf);
+
+    post_send_wr(wr, qp_index);
+}
+
+void RdmaBase::post_fetch_add(const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey, uint64_t add,
+                              bool cqe_event, size_t qp_index)
+{
+    post_atomic(IBV_WR_ATOMIC_FETCH_AND_ADD, result_buf, remote_addr, rkey, add, 0, cqe_event, qp_index);
+}
+
+void RdmaBase::post_cmp_swap(const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey,
+                             uint64_t compare, uint64_t swap, bool cqe_event, size_t qp_index)
+{
+    post_atomic(IBV_WR_ATOMIC_CMP_AND_SWP, result_buf, remote_addr, rkey, compare, swap, cqe_event, qp_index);
+}
+
+void RdmaBase::post_atomic(ibv_wr_opcode opcode, const Buffer& result_buf, uint64_t remote_addr, uint32_t rkey,
+                           uint64_t compare_add, uint64_t swap, bool cqe_event, size_t qp_index)
+{
+    // Atomics always work on 64 bits aligned words
+    if(result_buf.size < sizeof(uint64_t) || remote_addr % sizeof(uint64_t) != 0)
+    {
+        THROW_ERROR("Atomic operations need an 8 bytes result buffer and an 8 bytes aligned remote address");
+    }
+
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+
+    ibv_sge sge;
+    memset(&sge, 0, sizeof(sge));
+
+    // Only 1 scatter/gather entry (SGE)
+
+    wr.opcode = opcode;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
+    wr.wr_id = 123; // Arbitrary
+    wr.next = nullptr;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    wr.wr.atomic.remote_addr = remote_addr;
+    wr.wr.atomic.compare_add = compare_add;
+    wr.wr.atomic.swap = swap;
+    wr.wr.atomic.rkey = rkey;
+
+    sge.addr = reinterpret_cast<uintptr_t>(result_buf.data);
+    sge.length = sizeof(uint64_t);
+    sge.lkey = get_lkey(result_buf);
+
+    post_send_wr(wr, qp_index);
+}
+
+ibv_mr* RdmaBase::find_mr(const Buffer& buf)
+{
+    const auto contains = [&buf](const std::vector<uint8_t>& region) {
+        return buf.data >= region.data() && buf.data + buf.size <= region.data() + region.size();
+    };
+
+    if(contains(m_send_buf))
+    {
+        return m_send_mr;
+    }
+
+    if(contains(m_recv_buf))
+    {
+        return m_recv_mr;
+    }
+
+    for(ibv_mr* mr : m_extra_mrs)
+    {
+        const auto* begin = static_cast<const uint8_t*>(mr->addr);
+
+        if(buf.data >= begin && buf.data + buf.size <= begin + mr->length)
+        {
+            return mr;
+        }
+    }
+
+    THROW_ERROR("Buffer is not in a registered memory region");
+}
+
+uint32_t RdmaBase::post_bind_window(ibv_mw* mw, const Buffer& buf, int access, bool cqe_event, size_t qp_index)
+{
+    // A region registered without IBV_ACCESS_MW_BIND fails the bind with a completion error
+    ibv_mr* const mr = find_mr(buf);
+
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+
+    wr.opcode = IBV_WR_BIND_MW;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
+    // The low byte of the rkey is ours, changing it at each bind makes the previous rkey invalid
+    const uint32_t rkey = (mw->rkey & 0xFFFFFF00) | ((mw->rkey + 1) & 0xFF);
+
+    wr.wr_id = 123; // Arbitrary
+    wr.next = nullptr;
+
+    wr.bind_mw.mw = mw;
+    wr.bind_mw.rkey = rkey;
+    wr.bind_mw.bind_info.mr = mr;
+    wr.bind_mw.bind_info.addr = reinterpret_cast<uintptr_t>(buf.data);
+    wr.bind_mw.bind_info.length = buf.size;
+    wr.bind_mw.bind_info.mw_access_flags = static_cast<unsigned int>(access);
+
+    post_send_wr(wr, qp_index);
+
+    // Remember the current rkey, the next bind derives its rkey from it
+    mw->rkey = rkey;
+    return rkey;
+}
+
+void RdmaBase::post_invalidate(uint32_t rkey, bool cqe_event, size_t qp_index)
+{
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+
+    wr.opcode = IBV_WR_LOCAL_INV;
+
+    if(cqe_event)
+    {
+        wr.send_flags = IBV_SEND_SIGNALED;
+    }
+
+    wr.wr_id = 123; // Arbitrary
+    wr.next = nullptr;
+    wr.invalidate_rkey = rkey;
+
+    post_send_wr(wr, qp_index);
+}
+
+uint32_t RdmaBase::get_lkey(const Buffer& buf)
+{
+    return find_mr(buf)->lkey;
+}
+
+void RdmaBase::write_parallel(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey)
+{
+    wait_for_writes(post_write_chunks(send_buf, remote_addr, rkey));
+}
+
+void RdmaBase::write_parallel_imm(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey, uint32_t payload)
+{
+    if(m_ordering == Ordering::Strict || m_qps.size() == 1)
+    {
+        // A single QP is ordered, no need to wait before notifying
+        post_write_imm(send_buf, remote_addr, rkey, payload, true);
+        wait_for_writes(1);
+        return;
+    }
+
+    // There is no ordering between QPs, the notification must be sent after all the chunks are written
+    write_parallel(send_buf, remote_addr, rkey);
+
+    const Buffer empty{send_buf.data, 0};
+    post_write_imm(empty, remote_addr, rkey, payload, true);
+    wait_for_writes(1);
+}
+
+int RdmaBase::post_write_chunks(const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey)
+{
+    // Below this size, splitting costs more than it gains
+    const uint32_t min_chunk_sz = 64 * 1024;
+
+    const uint32_t max_chunks = (m_ordering == Ordering::Strict ? 1 : static_cast<uint32_t>(m_qps.size()));
+    const uint32_t num_chunks = std::max(1u, std::min(max_chunks, send_buf.size / min_chunk_sz));
+    // In 64 bits, so the rounding and the offsets do not wrap for buffers close to 4 GiB
+    const uint64_t size = send_buf.size;
+    const uint64_t chunk_sz = (size + num_chunks - 1) / num_chunks;
+
+    int posted = 0;
+    for(uint64_t offset = 0; offset < size || posted == 0; offset += chunk_sz)
+    {
+        const Buffer chunk{send_buf.data + offset, static_cast<uint32_t>(std::min(chunk_sz, size - offset))};
+        post_write(chunk, remote_addr + offset, rkey, true, static_cast<size_t>(posted));
+        posted++;
+    }
+
+    return posted;
+}
+
+void RdmaBase::wait_for_writes(int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        const ibv_wc wc = wait_event();
+
+        if(wc.opcode != IBV_WC_RDMA_WRITE)
+        {
+            THROW_ERROR("Expected IBV_WC_RDMA_WRITE event, got something different.");
+        }
+    }
+}
+
+void RdmaBase::create_timestamped_cq(ibv_context* const context)
+{
+    ibv_device_attr_ex device_attr{};
+    HTHROW_RET(ibv_query_device_ex(context, nullptr, &device_attr));
+
+    if(device_attr.completion_timestamp_mask == 0 || device_attr.hca_core_clock == 0)
+    {
+        spdlog::warn("The device does not support completion timestamps, the software ones are used");
+        return;
+    }
+
+    ibv_cq_init_attr_ex cq_attr{};
+    cq_attr.cqe = m_options.cq_size;
+    cq_attr.channel = m_comp_channel;
+    cq_attr.wc_flags = IBV_WC_STANDARD_FLAGS | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+
+    m_cq_ex = ibv_create_cq_ex(context, &cq_attr);
+    if(!m_cq_ex)
+    {
+        spdlog::warn("ibv_create_cq_ex() failed ({}), the software timestamps are used", strerror(errno));
+        return;
+    }
+
+    m_cq = ibv_cq_ex_to_cq(m_cq_ex);
+    m_hca_core_clock = device_attr.hca_core_clock;
+}
+
+void RdmaBase::post_send_wr(ibv_send_wr& wr, size_t qp_index)
+{
+    ibv_qp* const qp = get_qp(qp_index);
+
+    if(m_tracer)
+    {
+        for(const ibv_send_wr* it = &wr; it; it = it->next)
+        {
+            if(it->send_flags & IBV_SEND_SIGNALED)
+            {
+                m_tracer->on_post(qp->qp_num, it->wr_id, false);
+            }
+        }
+    }
+
+    ibv_send_wr* bad_wr = nullptr;
+    HTHROW_RET(ibv_post_send(qp, &wr, &bad_wr));
+}
+
+void RdmaBase::build_qp_init_attr(ibv_cq* const cq, ibv_qp_init_attr* qp_attr) const
 {
     // Initialize to zero
     std::memset(qp_attr, 0, sizeof(*qp_attr));
@@ -338,8 +1086,118 @@ void RdmaBase::build_qp_init_attr(ibv_cq* const cq, ibv_qp_init_attr* qp_attr)
     qp_attr->recv_cq = cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 100;
-    qp_attr->cap.max_recv_wr = 100;
-    qp_attr->cap.max_send_sge = 1;
-    qp_attr->cap.max_recv_sge = 1;
+    qp_attr->cap.max_send_wr = m_options.max_send_wr;
+    qp_attr->cap.max_recv_wr = m_options.max_recv_wr;
+    qp_attr->cap.max_send_sge = m_options.max_send_sge;
+    qp_attr->cap.max_recv_sge = m_options.max_recv_sge;
+    qp_attr->cap.max_inline_data = m_options.max_inline_data;
+}
+
+void RdmaBase::build_conn_param(rdma_conn_param* param, const rdma_conn_param* peer) const
+{
+    std::memset(param, 0, sizeof(*param));
+
+    param->responder_resources = static_cast<uint8_t>(std::min<uint32_t>(m_options.responder_resources, UINT8_MAX));
+    param->initiator_depth = static_cast<uint8_t>(std::min<uint32_t>(m_options.initiator_depth, UINT8_MAX));
+    param->retry_count = m_options.retry_count;
+    param->rnr_retry_count = m_options.rnr_retry_count;
+
+    // We can't have more READs in flight than the peer accepts, and the other way around
+    if(peer)
+    {
+        param->responder_resources = std::min(param->responder_resources, peer->initiator_depth);
+        param->initiator_depth = std::min(param->initiator_depth, peer->responder_resources);
+    }
+}
+
+void RdmaBase::setup_id(rdma_cm_id* const id)
+{
+    if(m_options.timeout != RdmaOptions::default_value)
+    {
+        uint8_t timeout = m_options.timeout;
+        HTHROW_ERRNO(rdma_set_option(id, RDMA_OPTION_ID, RDMA_OPTION_ID_ACK_TIMEOUT, &timeout, sizeof(timeout)) == 0);
+    }
+}
+
+void RdmaBase::setup_route(rdma_cm_id* const id, size_t qp_index)
+{
+    if(qp_index < m_options.type_of_service.size() && m_options.type_of_service[qp_index] != RdmaOptions::default_value)
+    {
+        uint8_t tos = m_options.type_of_service[qp_index];
+        HTHROW_ERRNO(rdma_set_option(id, RDMA_OPTION_ID, RDMA_OPTION_ID_TOS, &tos, sizeof(tos)) == 0);
+    }
+}
+
+void RdmaBase::on_qp_established(size_t qp_index)
+{
+    ibv_qp* const qp = get_qp(qp_index);
+
+    // rdma_cm moves the QP to RTS with its own RNR timer, it can only be changed afterwards
+    if(m_options.min_rnr_timer != RdmaOptions::default_value)
+    {
+        ibv_qp_attr attr{};
+        attr.min_rnr_timer = m_options.min_rnr_timer;
+        HTHROW_RET(ibv_modify_qp(qp, &attr, IBV_QP_MIN_RNR_TIMER));
+    }
+
+    if(m_options.path_mtu != 0)
+    {
+        ibv_qp_attr attr{};
+        ibv_qp_init_attr init_attr{};
+        HTHROW_RET(ibv_query_qp(qp, &attr, IBV_QP_PATH_MTU, &init_attr));
+
+        if(attr.path_mtu < m_options.path_mtu)
+        {
+            // IBV_MTU_256 == 1, IBV_MTU_512 == 2...
+            THROW_ERROR("Negotiated path MTU %d is lower than the required one %d",
+                        128 << attr.path_mtu, 128 << m_options.path_mtu);
+        }
+    }
+}
+
+void RdmaBase::validate_options(const ibv_device_attr& device_attr)
+{
+    const auto resolve = [](uint32_t& value, int device_limit, const char* name) {
+        const uint32_t limit = static_cast<uint32_t>(std::max(device_limit, 0));
+
+        if(value == RdmaOptions::device_max)
+        {
+            value = limit;
+        }
+        else if(value > limit)
+        {
+            THROW_ERROR("Option %s=%u exceeds the device limit %u", name, value, limit);
+        }
+    };
+
+    resolve(m_options.cq_size, device_attr.max_cqe, "cq_size");
+    resolve(m_options.max_send_wr, device_attr.max_qp_wr, "max_send_wr");
+    resolve(m_options.max_recv_wr, device_attr.max_qp_wr, "max_recv_wr");
+    resolve(m_options.max_send_sge, device_attr.max_sge, "max_send_sge");
+    resolve(m_options.max_recv_sge, device_attr.max_sge, "max_recv_sge");
+    resolve(m_options.responder_resources, device_attr.max_qp_rd_atom, "responder_resources");
+    resolve(m_options.initiator_depth, device_attr.max_qp_init_rd_atom, "initiator_depth");
+
+    if(m_options.retry_count > 7 || m_options.rnr_retry_count > 7)
+    {
+        THROW_ERROR("retry_count and rnr_retry_count should be at most 7");
+    }
+
+    if(m_options.min_rnr_timer != RdmaOptions::default_value && m_options.min_rnr_timer > 31)
+    {
+        THROW_ERROR("min_rnr_timer should be at most 31");
+    }
+
+    if(m_options.timeout != RdmaOptions::default_value && m_options.timeout > 31)
+    {
+        THROW_ERROR("timeout should be at most 31");
+    }
+
+    // A full CQ moves all the QPs to the error state
+    const uint64_t max_cqe = static_cast<uint64_t>(m_options.num_qps) * (m_options.max_send_wr + m_options.max_recv_wr);
+    if(m_options.cq_size < max_cqe)
+    {
+        spdlog::warn("cq_size={} is lower than the {} work requests that may be outstanding, the CQ may overflow",
+                     m_options.cq_size, max_cqe);
+    }
 }
\ No newline at end of file
@@ -6,18 +6,27 @@
 
 const int timeout_ms = 1'000 * 60; // 1min
 
-RdmaClient::RdmaClient(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port)
-    : RdmaBase(send_buf_sz, recv_buf_sz)
+RdmaClient::RdmaClient(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port,
+                       const std::string& local_addr, const RdmaOptions& options)
+    : RdmaBase(send_buf_sz, recv_buf_sz, options)
 {
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = server_port;
+    m_server_addr.sin_family = AF_INET;
+    m_server_addr.sin_port = server_port;
 
     spdlog::info("Created RDMA client to connect on address {}:{}", server_addr, server_port);
     spdlog::info("Created RDMA client buffer sizes: send={}, recv={}", send_buf_sz, recv_buf_sz);
 
-    HENSURE_ERRNO(inet_aton(server_addr.c_str(), reinterpret_cast<in_addr*>(&addr.sin_addr.s_addr)) >= 0);
-    HENSURE_ERRNO(rdma_resolve_addr(m_connection_id, nullptr, reinterpret_cast<sockaddr*>(&addr), timeout_ms) == 0);
+    HTHROW_ERRNO(inet_aton(server_addr.c_str(), &m_server_addr.sin_addr) != 0);
+
+    if(!local_addr.empty())
+    {
+        spdlog::info("Created RDMA client bound to local address {}", local_addr);
+
+        m_local_addr.sin_family = AF_INET;
+        HTHROW_ERRNO(inet_aton(local_addr.c_str(), &m_local_addr.sin_addr) != 0);
+    }
+
+    resolve_addr(m_connection_id);
 }
 
 RdmaClient::~RdmaClient()
@@ -48,7 +57,7 @@ bool RdmaClient::on_event_received(rdma_cm_event* const event)
             return false; // Breaks the event loop
 
         default:
-            FATAL_ERROR("on_event_received(): Unknown RDMA event: %d", (int)event->event);
+            THROW_ERROR("on_event_received(): Unknown RDMA event: %d", (int)event->event);
             break;
     }
 
@@ -63,26 +72,43 @@ void RdmaClient::on_addr_resolved(rdma_cm_id* const id)
 
     ibv_qp_init_attr attr{};
     build_qp_init_attr(m_cq, &attr);
-    HENSURE_ERRNO(rdma_create_qp(id, m_pd, &attr) == 0);
+    HTHROW_ERRNO(rdma_create_qp(id, m_pd, &attr) == 0);
 
     // The ID that will be use for send/recv
-    m_qp = id->qp;
-    m_qp_id = id;
+    // Its context is the index of the QP in the connection
+    const size_t qp_index = reinterpret_cast<uintptr_t>(id->context);
+    m_qps[qp_index].qp = id->qp;
 
     // Pre-post receive event on the to be sure there is one receive work
     // before the remote sends a message
-    post_receive();
+    if(m_options.prepost_receive)
+    {
+        post_receive(qp_index);
+    }
+
+    // The type of service selects the path, it should be set before resolving it
+    setup_route(id, qp_index);
 
     const int timeout_ms = 1'000 * 60; // 1min
-    HENSURE_ERRNO(rdma_resolve_route(id, timeout_ms) == 0);
+    HTHROW_ERRNO(rdma_resolve_route(id, timeout_ms) == 0);
 }
 
 void RdmaClient::on_route_resolved(rdma_cm_id* const id)
 {
     spdlog::info("RDMA route resolved");
 
+    // Tell the server which QP of the connection this is
+    ConnectInfo info{};
+    info.qp_index = static_cast<uint16_t>(reinterpret_cast<uintptr_t>(id->context));
+    info.num_qps = static_cast<uint16_t>(m_qps.size());
+
+    setup_id(id);
+
     rdma_conn_param param{};
-    HENSURE_ERRNO(rdma_connect(id, &param) == 0);
+    build_conn_param(&param);
+    param.private_data = &info;
+    param.private_data_len = sizeof(info);
+    HTHROW_ERRNO(rdma_connect(id, &param) == 0);
 }
 
 void RdmaClient::on_connect(rdma_cm_id* const id)
@@ -95,15 +121,28 @@ void RdmaClient::on_disconnect(rdma_cm_id* const id)
     spdlog::info("RDMA connection disconnected");
 
     rdma_destroy_qp(id);
-    HENSURE_ERRNO(rdma_destroy_id(id) == 0);
+    HTHROW_ERRNO(rdma_destroy_id(id) == 0);
 }
 
 void RdmaClient::wait_until_connected()
 {
     spdlog::info("Waiting RDMA connection to server...");
 
-    bool stop = false;
-    while(!stop)
+    // The main ID is created by the constructor, create one more ID for each additional QP
+    if(m_qps.empty())
+    {
+        m_qps.resize(m_options.num_qps);
+        m_qps[0].id = m_connection_id;
+
+        for(uint32_t i = 1; i < m_options.num_qps; i++)
+        {
+            HTHROW_ERRNO(rdma_create_id(m_event_channel, &m_qps[i].id, reinterpret_cast<void*>(uintptr_t{i}), RDMA_PS_TCP) == 0);
+            resolve_addr(m_qps[i].id);
+        }
+    }
+
+    size_t num_established = 0;
+    while(num_established < m_qps.size())
     {
         const rdma_cm_event event = wait_cm_event();
 
@@ -118,14 +157,59 @@ void RdmaClient::wait_until_connected()
                 break;
 
             case RDMA_CM_EVENT_ESTABLISHED:
-                stop = true;
+                if(event.id == m_connection_id)
+                {
+                    m_peer_private_data = m_event_private_data;
+                }
+
+                on_qp_established(reinterpret_cast<uintptr_t>(event.id->context));
+                num_established++;
                 break;
 
-            default:
-                FATAL_ERROR("Unknown RDMA event: %d", static_cast<int>(event.event));
+            case RDMA_CM_EVENT_ADDR_ERROR:
+            case RDMA_CM_EVENT_ROUTE_ERROR:
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+            case RDMA_CM_EVENT_UNREACHABLE:
+            case RDMA_CM_EVENT_REJECTED:
+                THROW_ERROR("Connection to server failed: %s (status %d)", rdma_event_str(event.event), event.status);
+
+            case RDMA_CM_EVENT_DISCONNECTED:
+            case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+                // Left over from a previous connection
+                spdlog::warn("Ignored RDMA event while connecting: {}", rdma_event_str(event.event));
                 break;
+
+            default:
+                THROW_ERROR("Unknown RDMA event: %d", static_cast<int>(event.event));
         }
     }
 
-    spdlog::info("RDMA connection established");
+    spdlog::info("RDMA connection established with {} QP(s)", m_qps.size());
+}
+
+void RdmaClient::reconnect()
+{
+    spdlog::info("Reconnecting RDMA client");
+
+    destroy_qp();
+
+    // The ID is not in `m_qps` yet if the previous attempt failed early
+    if(m_connection_id)
+    {
+        HTHROW_ERRNO(rdma_destroy_id(m_connection_id) == 0);
+        m_connection_id = nullptr;
+    }
+
+    HTHROW_ERRNO(rdma_create_id(m_event_channel, &m_connection_id, nullptr, RDMA_PS_TCP) == 0);
+    resolve_addr(m_connection_id);
+
+    wait_until_connected();
+}
+
+void RdmaClient::resolve_addr(rdma_cm_id* const id)
+{
+    // The source address selects the device and port used by the connection
+    sockaddr* const src_addr = (m_local_addr.sin_family == AF_INET ? reinterpret_cast<sockaddr*>(&m_local_addr) : nullptr);
+
+    HTHROW_ERRNO(rdma_resolve_addr(id, src_addr, reinterpret_cast<sockaddr*>(&m_server_addr), timeout_ms) == 0);
 }
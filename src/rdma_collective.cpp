@@ -0,0 +1,597 @@
+#include "rdma_collective.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HELPER_RDMA_AVX2 1
+#endif
+
+namespace
+{
+
+// The right neighbour may not be listening yet when we start
+const int max_connect_attempts = 100;
+const std::chrono::milliseconds connect_backoff(100);
+
+// Size of a credit message
+const uint32_t credit_sz = sizeof(uint32_t);
+
+struct Sum
+{
+    template<typename T>
+    static T apply(T a, T b)
+    {
+        return a + b;
+    }
+};
+
+struct Prod
+{
+    template<typename T>
+    static T apply(T a, T b)
+    {
+        return a * b;
+    }
+};
+
+struct Min
+{
+    template<typename T>
+    static T apply(T a, T b)
+    {
+        return std::min(a, b);
+    }
+};
+
+struct Max
+{
+    template<typename T>
+    static T apply(T a, T b)
+    {
+        return std::max(a, b);
+    }
+};
+
+// Portable kernel, the loop is simple enough for the compiler to vectorize it
+template<typename T, typename Op>
+void reduce_scalar(void* dst, const void* src, size_t bytes)
+{
+    T* __restrict d = static_cast<T*>(dst);
+    const T* __restrict s = static_cast<const T*>(src);
+    const size_t n = bytes / sizeof(T);
+
+    for(size_t i = 0; i < n; i++)
+    {
+        d[i] = Op::apply(d[i], s[i]);
+    }
+}
+
+#ifdef HELPER_RDMA_AVX2
+
+// AVX2 kernels, selected at runtime so the library does not need to be built with -mavx2.
+// Each one processes 32 bytes per iteration, then the tail with the portable kernel.
+#define HELPER_RDMA_AVX2_KERNEL(name, T, Op, vec, load, store, vec_op) \
+    __attribute__((target("avx2"))) void name(void* dst, const void* src, size_t bytes) \
+    { \
+        T* d = static_cast<T*>(dst); \
+        const T* s = static_cast<const T*>(src); \
+        const size_t n = bytes / sizeof(T); \
+        const size_t lanes = 32 / sizeof(T); \
+        size_t i = 0; \
+        for(; i + lanes <= n; i += lanes) \
+        { \
+            const vec a = load(reinterpret_cast<const vec*>(d + i)); \
+            const vec b = load(reinterpret_cast<const vec*>(s + i)); \
+            store(reinterpret_cast<vec*>(d + i), vec_op(a, b)); \
+        } \
+        reduce_scalar<T, Op>(d + i, s + i, (n - i) * sizeof(T)); \
+    }
+
+#define HELPER_RDMA_LOAD_PS(p) _mm256_loadu_ps(reinterpret_cast<const float*>(p))
+#define HELPER_RDMA_STORE_PS(p, v) _mm256_storeu_ps(reinterpret_cast<float*>(p), v)
+#define HELPER_RDMA_LOAD_PD(p) _mm256_loadu_pd(reinterpret_cast<const double*>(p))
+#define HELPER_RDMA_STORE_PD(p, v) _mm256_storeu_pd(reinterpret_cast<double*>(p), v)
+
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_f32, float, Sum, __m256, HELPER_RDMA_LOAD_PS, HELPER_RDMA_STORE_PS, _mm256_add_ps)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_prod_f32, float, Prod, __m256, HELPER_RDMA_LOAD_PS, HELPER_RDMA_STORE_PS, _mm256_mul_ps)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_min_f32, float, Min, __m256, HELPER_RDMA_LOAD_PS, HELPER_RDMA_STORE_PS, _mm256_min_ps)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_max_f32, float, Max, __m256, HELPER_RDMA_LOAD_PS, HELPER_RDMA_STORE_PS, _mm256_max_ps)
+
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_f64, double, Sum, __m256d, HELPER_RDMA_LOAD_PD, HELPER_RDMA_STORE_PD, _mm256_add_pd)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_prod_f64, double, Prod, __m256d, HELPER_RDMA_LOAD_PD, HELPER_RDMA_STORE_PD, _mm256_mul_pd)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_min_f64, double, Min, __m256d, HELPER_RDMA_LOAD_PD, HELPER_RDMA_STORE_PD, _mm256_min_pd)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_max_f64, double, Max, __m256d, HELPER_RDMA_LOAD_PD, HELPER_RDMA_STORE_PD, _mm256_max_pd)
+
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_i32, int32_t, Sum, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_add_epi32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_prod_i32, int32_t, Prod, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_mullo_epi32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_min_i32, int32_t, Min, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_min_epi32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_max_i32, int32_t, Max, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_max_epi32)
+
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_u32, uint32_t, Sum, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_add_epi32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_prod_u32, uint32_t, Prod, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_mullo_epi32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_min_u32, uint32_t, Min, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_min_epu32)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_max_u32, uint32_t, Max, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_max_epu32)
+
+// AVX2 has no 64 bits integer multiplication, minimum or maximum
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_i64, int64_t, Sum, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_add_epi64)
+HELPER_RDMA_AVX2_KERNEL(reduce_avx2_sum_u64, uint64_t, Sum, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_add_epi64)
+
+#undef HELPER_RDMA_AVX2_KERNEL
+
+bool has_avx2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#endif
+
+// AVX2 kernels of a type, in the order of `ReduceOp`, nullptr when there is none
+template<typename T>
+struct Avx2Kernels
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {nullptr, nullptr, nullptr, nullptr};
+};
+
+#ifdef HELPER_RDMA_AVX2
+
+template<>
+struct Avx2Kernels<float>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_f32, reduce_avx2_prod_f32, reduce_avx2_min_f32, reduce_avx2_max_f32};
+};
+
+template<>
+struct Avx2Kernels<double>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_f64, reduce_avx2_prod_f64, reduce_avx2_min_f64, reduce_avx2_max_f64};
+};
+
+template<>
+struct Avx2Kernels<int32_t>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_i32, reduce_avx2_prod_i32, reduce_avx2_min_i32, reduce_avx2_max_i32};
+};
+
+template<>
+struct Avx2Kernels<uint32_t>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_u32, reduce_avx2_prod_u32, reduce_avx2_min_u32, reduce_avx2_max_u32};
+};
+
+template<>
+struct Avx2Kernels<int64_t>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_i64, nullptr, nullptr, nullptr};
+};
+
+template<>
+struct Avx2Kernels<uint64_t>
+{
+    static constexpr void (*kernels[4])(void*, const void*, size_t) = {
+        reduce_avx2_sum_u64, nullptr, nullptr, nullptr};
+};
+
+#endif
+
+template<typename T>
+void (*select_kernel(RdmaCommunicator::ReduceOp op))(void*, const void*, size_t)
+{
+#ifdef HELPER_RDMA_AVX2
+    const auto avx2 = Avx2Kernels<T>::kernels[static_cast<int>(op)];
+    if(avx2 && has_avx2())
+    {
+        return avx2;
+    }
+#endif
+
+    switch(op)
+    {
+        case RdmaCommunicator::ReduceOp::Sum:
+            return reduce_scalar<T, Sum>;
+
+        case RdmaCommunicator::ReduceOp::Prod:
+            return reduce_scalar<T, Prod>;
+
+        case RdmaCommunicator::ReduceOp::Min:
+            return reduce_scalar<T, Min>;
+
+        case RdmaCommunicator::ReduceOp::Max:
+            return reduce_scalar<T, Max>;
+    }
+
+    THROW_ERROR("Unknown reduction operation %d", static_cast<int>(op));
+}
+
+}
+
+RdmaCommunicator::RdmaCommunicator(const std::vector<Endpoint>& ranks, size_t rank, uint32_t segment_size,
+                                   uint32_t num_slots, const RdmaOptions& options)
+    : m_rank(rank),
+      m_size(ranks.size()),
+      m_segment_sz(segment_size),
+      m_num_slots(num_slots)
+{
+    if(rank >= ranks.size())
+    {
+        THROW_ERROR("Rank %zu is out of the %zu ranks", rank, ranks.size());
+    }
+
+    // Segments are cut on whole elements, of 8 bytes at most
+    if(segment_size < sizeof(uint64_t) || num_slots == 0)
+    {
+        THROW_ERROR("Invalid segment size %u or number of slots %u", segment_size, num_slots);
+    }
+
+    if(static_cast<uint64_t>(segment_size) * num_slots > UINT32_MAX)
+    {
+        THROW_ERROR("The staging slots do not fit in a buffer");
+    }
+
+    if(m_size > 1)
+    {
+        connect(ranks, options);
+        exchange_slots_info();
+    }
+}
+
+void RdmaCommunicator::connect(const std::vector<Endpoint>& ranks, const RdmaOptions& options)
+{
+    RdmaOptions ring_options = options;
+
+    // The receives are posted per staging slot and per credit
+    ring_options.prepost_receive = false;
+
+    if(ring_options.max_send_wr < m_num_slots || ring_options.max_recv_wr < m_num_slots)
+    {
+        THROW_ERROR("%u staging slots need as many send and receive work requests", m_num_slots);
+    }
+
+    const uint32_t staging_sz = m_segment_sz * m_num_slots;
+    const uint32_t control_sz = std::max<uint32_t>(credit_sz * m_num_slots, sizeof(SlotsInfo));
+
+    const Endpoint& self = ranks[m_rank];
+    const Endpoint& next = ranks[(m_rank + 1) % m_size];
+
+    // Our left neighbour writes in our receiving buffer, we send it credits
+    m_prev = std::make_unique<RdmaServer>(control_sz, staging_sz, self.addr, self.port, ring_options);
+
+    // Accept in the background: the left neighbour may be waiting for its own left neighbour
+    std::exception_ptr accept_error;
+    std::thread accept_thread([this, &accept_error] {
+        try
+        {
+            m_prev->wait_until_connected();
+        }
+        catch(...)
+        {
+            accept_error = std::current_exception();
+        }
+    });
+
+    try
+    {
+        for(int attempt = 1;; attempt++)
+        {
+            try
+            {
+                m_next = std::make_unique<RdmaClient>(staging_sz, control_sz, next.addr, next.port, "", ring_options);
+                m_next->wait_until_connected();
+                break;
+            }
+            catch(const helper_rdma::Error& e)
+            {
+                m_next.reset();
+
+                if(attempt == max_connect_attempts)
+                {
+                    throw;
+                }
+
+                spdlog::info("Rank {} is not ready yet ({}), retrying", (m_rank + 1) % m_size, e.what());
+                std::this_thread::sleep_for(connect_backoff);
+            }
+        }
+    }
+    catch(...)
+    {
+        // The left neighbour may never connect, stop waiting for it
+        m_prev->interrupt_cm_wait();
+        accept_thread.join();
+        throw;
+    }
+
+    accept_thread.join();
+
+    if(accept_error)
+    {
+        std::rethrow_exception(accept_error);
+    }
+
+    spdlog::info("Rank {}/{} connected to its neighbours", m_rank, m_size);
+}
+
+void RdmaCommunicator::exchange_slots_info()
+{
+    const Buffer info_buf{m_next->get_recv_buf().data, sizeof(SlotsInfo)};
+    m_next->post_receive(info_buf, 0);
+
+    SlotsInfo info{};
+    info.addr = reinterpret_cast<uint64_t>(m_prev->get_recv_buf().data);
+    info.rkey = m_prev->get_recv_rkey();
+    info.num_slots = m_num_slots;
+    info.segment_size = m_segment_sz;
+
+    std::memcpy(m_prev->get_send_buf().data, &info, sizeof(info));
+    m_prev->post_send(Buffer{m_prev->get_send_buf().data, sizeof(info)}, 0);
+
+    uint32_t size = 0;
+    m_prev->wait_for_send();
+    m_next->wait_for_recv(size);
+
+    std::memcpy(&m_remote, info_buf.data, sizeof(m_remote));
+    if(size != sizeof(SlotsInfo) || m_remote.num_slots != m_num_slots || m_remote.segment_size != m_segment_sz)
+    {
+        THROW_ERROR("The ranks are not configured with the same segment size and number of slots");
+    }
+
+    // From now on, the receives are the credits on the right, and the segments on the left
+    for(uint32_t slot = 0; slot < m_num_slots; slot++)
+    {
+        m_next->post_receive(Buffer{m_next->get_recv_buf().data + slot * credit_sz, credit_sz}, slot);
+        m_prev->post_receive(Buffer{m_prev->get_recv_buf().data, 0}, slot);
+    }
+
+    m_credits = m_num_slots;
+}
+
+void RdmaCommunicator::split(std::vector<Segment>& segments, uint8_t* data, size_t size, size_t elem_size,
+                             bool reduce) const
+{
+    const uint32_t max_sz = static_cast<uint32_t>(m_segment_sz / elem_size * elem_size);
+
+    for(size_t offset = 0; offset < size; offset += max_sz)
+    {
+        const uint32_t segment_sz = static_cast<uint32_t>(std::min<size_t>(max_sz, size - offset));
+        segments.push_back({data + offset, segment_sz, reduce});
+    }
+}
+
+void RdmaCommunicator::poll_completions()
+{
+    ibv_wc wc{};
+
+    while(m_next->poll_event(wc))
+    {
+        if(wc.opcode & IBV_WC_RECV)
+        {
+            // A credit: the right neighbour processed a slot
+            const uint32_t slot = static_cast<uint32_t>(wc.wr_id);
+            m_next->post_receive(Buffer{m_next->get_recv_buf().data + slot * credit_sz, credit_sz}, slot);
+            m_credits++;
+        }
+        else if(wc.opcode != IBV_WC_RDMA_WRITE)
+        {
+            THROW_ERROR("Unexpected completion opcode %d from the right neighbour", static_cast<int>(wc.opcode));
+        }
+    }
+
+    while(m_prev->poll_event(wc))
+    {
+        if(wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+        {
+            m_arrivals.push_back({wc.imm_data, wc.byte_len});
+        }
+        else if(wc.opcode != IBV_WC_SEND)
+        {
+            THROW_ERROR("Unexpected completion opcode %d from the left neighbour", static_cast<int>(wc.opcode));
+        }
+    }
+}
+
+bool RdmaCommunicator::try_send(const Segment& segment)
+{
+    if(m_credits == 0)
+    {
+        return false;
+    }
+
+    const uint32_t slot = static_cast<uint32_t>(m_send_seq % m_num_slots);
+    const Buffer staging{m_next->get_send_buf().data + static_cast<size_t>(slot) * m_segment_sz, segment.size};
+
+    // The slot of the send buffer is free: its previous segment was received, since its credit came back
+    std::memcpy(staging.data, segment.data, segment.size);
+    m_next->post_write_imm(staging, m_remote.addr + static_cast<uint64_t>(slot) * m_segment_sz, m_remote.rkey,
+                           slot, true);
+
+    m_credits--;
+    m_send_seq++;
+    return true;
+}
+
+void RdmaCommunicator::receive(const Segment& segment, ReduceFn reduce)
+{
+    const Arrival arrival = m_arrivals.front();
+    m_arrivals.pop_front();
+
+    const uint32_t expected_slot = static_cast<uint32_t>(m_recv_seq % m_num_slots);
+    if(arrival.slot != expected_slot || arrival.size != segment.size)
+    {
+        THROW_ERROR("Unexpected segment of %u bytes in slot %u, the ranks are not running the same collective",
+                    arrival.size, arrival.slot);
+    }
+
+    const uint8_t* staging = m_prev->get_recv_buf().data + static_cast<size_t>(arrival.slot) * m_segment_sz;
+
+    if(segment.reduce)
+    {
+        reduce(segment.data, staging, segment.size);
+    }
+    else
+    {
+        std::memcpy(segment.data, staging, segment.size);
+    }
+
+    m_recv_seq++;
+
+    // Repost before giving the credit, so the next segment of this slot always has a receive
+    m_prev->post_receive(Buffer{m_prev->get_recv_buf().data, 0}, arrival.slot);
+
+    uint8_t* credit = m_prev->get_send_buf().data + arrival.slot * credit_sz;
+    std::memcpy(credit, &arrival.slot, credit_sz);
+    m_prev->post_send(Buffer{credit, credit_sz}, arrival.slot);
+}
+
+void RdmaCommunicator::run(const std::vector<Segment>& out, const std::vector<Segment>& in, size_t lag,
+                           ReduceFn reduce)
+{
+    size_t sent = 0;
+    size_t received = 0;
+
+    while(sent < out.size() || received < in.size())
+    {
+        poll_completions();
+
+        while(received < in.size() && !m_arrivals.empty())
+        {
+            receive(in[received], reduce);
+            received++;
+        }
+
+        // `out[sent]` carries the data of `in[sent - lag]`, it can only leave once it arrived
+        while(sent < out.size() && (sent < lag || received > sent - lag) && try_send(out[sent]))
+        {
+            sent++;
+        }
+    }
+}
+
+void RdmaCommunicator::broadcast(void* data, size_t size, size_t root)
+{
+    if(root >= m_size)
+    {
+        THROW_ERROR("Root %zu is out of the %zu ranks", root, m_size);
+    }
+
+    if(m_size == 1)
+    {
+        return;
+    }
+
+    std::vector<Segment> segments;
+    split(segments, static_cast<uint8_t*>(data), size, 1, false);
+
+    const std::vector<Segment> none;
+    const bool is_last = (m_rank + 1) % m_size == root;
+
+    if(m_rank == root)
+    {
+        run(segments, none, segments.size(), nullptr);
+    }
+    else if(is_last)
+    {
+        run(none, segments, 0, nullptr);
+    }
+    else
+    {
+        // Forward each segment as soon as it arrives
+        run(segments, segments, 0, nullptr);
+    }
+}
+
+void RdmaCommunicator::all_gather(const void* in, void* out, size_t block_size)
+{
+    auto* blocks = static_cast<uint8_t*>(out);
+    std::memmove(blocks + m_rank * block_size, in, block_size);
+
+    if(m_size == 1)
+    {
+        return;
+    }
+
+    // At the step s, send the block of rank (r - s) and receive the one of rank (r - s - 1).
+    // The block sent at the step s + 1 is the one received at the step s.
+    std::vector<Segment> send_segments;
+    std::vector<Segment> recv_segments;
+
+    for(size_t step = 0; step + 1 < m_size; step++)
+    {
+        const size_t send_block = (m_rank + m_size - step) % m_size;
+        const size_t recv_block = (m_rank + m_size - step - 1) % m_size;
+
+        split(send_segments, blocks + send_block * block_size, block_size, 1, false);
+        split(recv_segments, blocks + recv_block * block_size, block_size, 1, false);
+    }
+
+    const size_t segments_per_block = send_segments.size() / (m_size - 1);
+    run(send_segments, recv_segments, segments_per_block, nullptr);
+}
+
+void RdmaCommunicator::reduce_scatter_all_gather(uint8_t* data, size_t count, size_t elem_size, ReduceFn reduce)
+{
+    // The block b is the elements [b * count / n, (b + 1) * count / n)
+    const auto block = [&](size_t b) {
+        const size_t begin = b * count / m_size;
+        const size_t end = (b + 1) * count / m_size;
+        return std::make_pair(data + begin * elem_size, (end - begin) * elem_size);
+    };
+
+    std::vector<Segment> send_segments;
+    std::vector<Segment> recv_segments;
+
+    // Reduce-scatter: at the step s, send the block (r - s) and reduce the block (r - s - 1).
+    // After n - 1 steps, the block (r + 1) is fully reduced.
+    for(size_t step = 0; step + 1 < m_size; step++)
+    {
+        const auto send_block = block((m_rank + m_size - step) % m_size);
+        const auto recv_block = block((m_rank + 2 * m_size - step - 1) % m_size);
+
+        split(send_segments, send_block.first, send_block.second, elem_size, false);
+        split(recv_segments, recv_block.first, recv_block.second, elem_size, true);
+    }
+
+    // All-gather of the reduced blocks: at the step s, send the block (r + 1 - s) and copy the block (r - s)
+    for(size_t step = 0; step + 1 < m_size; step++)
+    {
+        const auto send_block = block((m_rank + 1 + m_size - step) % m_size);
+        const auto recv_block = block((m_rank + m_size - step) % m_size);
+
+        split(send_segments, send_block.first, send_block.second, elem_size, false);
+        split(recv_segments, recv_block.first, recv_block.second, elem_size, false);
+    }
+
+    // In both phases, the block sent at a step is the one received at the previous step,
+    // so the segments sent lag the received ones by the segments of the first block sent
+    std::vector<Segment> first_block;
+    const auto own_block = block(m_rank);
+    split(first_block, own_block.first, own_block.second, elem_size, false);
+
+    run(send_segments, recv_segments, first_block.size(), reduce);
+}
+
+template<typename T>
+void RdmaCommunicator::all_reduce(T* data, size_t count, ReduceOp op)
+{
+    const ReduceFn reduce = select_kernel<T>(op);
+
+    if(m_size > 1)
+    {
+        reduce_scatter_all_gather(reinterpret_cast<uint8_t*>(data), count, sizeof(T), reduce);
+    }
+}
+
+template void RdmaCommunicator::all_reduce<float>(float*, size_t, ReduceOp);
+template void RdmaCommunicator::all_reduce<double>(double*, size_t, ReduceOp);
+template void RdmaCommunicator::all_reduce<int32_t>(int32_t*, size_t, ReduceOp);
+template void RdmaCommunicator::all_reduce<uint32_t>(uint32_t*, size_t, ReduceOp);
+template void RdmaCommunicator::all_reduce<int64_t>(int64_t*, size_t, ReduceOp);
+template void RdmaCommunicator::all_reduce<uint64_t>(uint64_t*, size_t, ReduceOp);
@@ -0,0 +1,497 @@
+#include "rdma_compress.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+// Size of a credit message
+const uint32_t credit_sz = sizeof(uint32_t);
+
+// Shorter runs of zeroes are cheaper to keep in the literals than to encode
+const size_t min_zero_run = 8;
+
+uint64_t load64(const uint8_t* p)
+{
+    uint64_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+// true if one of the 8 bytes of `x` is zero
+bool has_zero_byte(uint64_t x)
+{
+    return ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+}
+
+// LEB128, returns false if `out` is full
+bool put_varint(uint8_t*& out, const uint8_t* end, uint64_t value)
+{
+    do
+    {
+        if(out == end)
+        {
+            return false;
+        }
+
+        *out++ = static_cast<uint8_t>((value & 0x7F) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while(value != 0);
+
+    return true;
+}
+
+uint64_t get_varint(const uint8_t*& in, const uint8_t* end)
+{
+    uint64_t value = 0;
+
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        if(in == end)
+        {
+            break;
+        }
+
+        const uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+        if(!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+
+    THROW_ERROR("Corrupted compressed chunk: truncated length");
+}
+
+/**
+ * Encode as a sequence of (number of zeroes, number of literals, literals).
+ * @returns The encoded size, or 0 if it does not fit in `capacity`.
+ */
+size_t zero_run_encode(const uint8_t* in, size_t size, uint8_t* out, size_t capacity)
+{
+    uint8_t* o = out;
+    const uint8_t* const out_end = out + capacity;
+    size_t i = 0;
+
+    while(i < size)
+    {
+        // Zeroes, 8 bytes at a time
+        size_t z = i;
+        while(z + 8 <= size && load64(in + z) == 0)
+        {
+            z += 8;
+        }
+        while(z < size && in[z] == 0)
+        {
+            z++;
+        }
+
+        // Literals until the next long enough run of zeroes.
+        // A word without any zero byte can not contain the start of a run, it is skipped at once.
+        size_t l = z;
+        while(l < size)
+        {
+            if(l + min_zero_run <= size)
+            {
+                const uint64_t word = load64(in + l);
+                if(word == 0)
+                {
+                    break;
+                }
+                if(!has_zero_byte(word))
+                {
+                    l += 8;
+                    continue;
+                }
+            }
+            l++;
+        }
+        l = std::min(l, size);
+
+        if(!put_varint(o, out_end, z - i) || !put_varint(o, out_end, l - z)
+           || static_cast<size_t>(out_end - o) < l - z)
+        {
+            return 0;
+        }
+
+        std::memcpy(o, in + z, l - z);
+        o += l - z;
+        i = l;
+    }
+
+    return static_cast<size_t>(o - out);
+}
+
+void zero_run_decode(const uint8_t* in, size_t size, uint8_t* out, size_t raw_size)
+{
+    const uint8_t* const in_end = in + size;
+    size_t o = 0;
+
+    while(in < in_end)
+    {
+        const uint64_t zeroes = get_varint(in, in_end);
+        const uint64_t literals = get_varint(in, in_end);
+
+        if(zeroes > raw_size - o || literals > raw_size - o - zeroes
+           || literals > static_cast<size_t>(in_end - in))
+        {
+            THROW_ERROR("Corrupted compressed chunk: run out of bounds");
+        }
+
+        std::memset(out + o, 0, zeroes);
+        o += zeroes;
+
+        std::memcpy(out + o, in, literals);
+        o += literals;
+        in += literals;
+    }
+
+    if(o != raw_size)
+    {
+        THROW_ERROR("Corrupted compressed chunk: %zu bytes decoded instead of %zu", o, raw_size);
+    }
+}
+
+// Difference between consecutive 32 bits words, the trailing bytes are copied
+void delta_encode(const uint8_t* in, size_t size, uint8_t* out)
+{
+    const size_t n = size / sizeof(uint32_t);
+    uint32_t previous = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        uint32_t x;
+        std::memcpy(&x, in + i * sizeof(x), sizeof(x));
+
+        const uint32_t delta = x - previous;
+        std::memcpy(out + i * sizeof(x), &delta, sizeof(delta));
+        previous = x;
+    }
+
+    std::memcpy(out + n * sizeof(uint32_t), in + n * sizeof(uint32_t), size % sizeof(uint32_t));
+}
+
+// In place
+void delta_decode(uint8_t* data, size_t size)
+{
+    const size_t n = size / sizeof(uint32_t);
+    uint32_t previous = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        uint32_t delta;
+        std::memcpy(&delta, data + i * sizeof(delta), sizeof(delta));
+
+        previous += delta;
+        std::memcpy(data + i * sizeof(previous), &previous, sizeof(previous));
+    }
+}
+
+// Returns 0 if the encoded chunk is not smaller than `capacity`
+size_t encode(RdmaCodec codec, const uint8_t* in, size_t size, uint8_t* out, size_t capacity, uint8_t* scratch)
+{
+    switch(codec)
+    {
+        case RdmaCodec::Raw:
+            break;
+
+        case RdmaCodec::ZeroRun:
+            return zero_run_encode(in, size, out, capacity);
+
+        case RdmaCodec::DeltaZeroRun:
+            delta_encode(in, size, scratch);
+            return zero_run_encode(scratch, size, out, capacity);
+    }
+
+    return 0;
+}
+
+void check_slots(RdmaBase& conn, uint32_t chunk_size, uint32_t num_slots)
+{
+    if(conn.get_options().prepost_receive)
+    {
+        THROW_ERROR("Compressed streams should be created with RdmaOptions::prepost_receive disabled");
+    }
+
+    if(chunk_size == 0 || num_slots == 0 || num_slots > conn.get_options().max_recv_wr
+       || num_slots > conn.get_options().max_send_wr)
+    {
+        THROW_ERROR("Invalid chunk size %u or number of slots %u", chunk_size, num_slots);
+    }
+}
+
+}
+
+RdmaCompressedSender::RdmaCompressedSender(RdmaBase& conn, uint32_t chunk_size, uint32_t num_slots)
+    : m_conn(conn),
+      m_chunk_sz(chunk_size),
+      m_num_slots(num_slots),
+      m_credits(num_slots),
+      m_scratch(chunk_size)
+{
+    check_slots(conn, chunk_size, num_slots);
+
+    const uint64_t slots_sz = static_cast<uint64_t>(sizeof(RdmaChunkHeader) + chunk_size) * num_slots;
+    if(conn.get_send_buf().size < slots_sz || conn.get_recv_buf().size < credit_sz * num_slots)
+    {
+        THROW_ERROR("Buffers are too small for %u chunks of %u bytes", num_slots, chunk_size);
+    }
+
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        m_free_slots.push_back(num_slots - 1 - i);
+        m_conn.post_receive(credit_slot(i), i);
+    }
+}
+
+RdmaCompressedSender::Buffer RdmaCompressedSender::send_slot(uint32_t i)
+{
+    const uint32_t slot_sz = static_cast<uint32_t>(sizeof(RdmaChunkHeader)) + m_chunk_sz;
+    return {m_conn.get_send_buf().data + static_cast<size_t>(i) * slot_sz, slot_sz};
+}
+
+RdmaCompressedSender::Buffer RdmaCompressedSender::credit_slot(uint32_t i)
+{
+    return {m_conn.get_recv_buf().data + i * credit_sz, credit_sz};
+}
+
+void RdmaCompressedSender::process_completion(const ibv_wc& wc)
+{
+    if(wc.opcode & IBV_WC_RECV)
+    {
+        // The receiver decoded a chunk, its receive is posted again
+        const uint32_t slot = static_cast<uint32_t>(wc.wr_id);
+        m_conn.post_receive(credit_slot(slot), slot);
+        m_credits++;
+    }
+    else if(wc.opcode == IBV_WC_SEND)
+    {
+        m_free_slots.push_back(static_cast<uint32_t>(wc.wr_id));
+    }
+    else
+    {
+        THROW_ERROR("Unexpected completion opcode %d in compressed stream", static_cast<int>(wc.opcode));
+    }
+}
+
+uint32_t RdmaCompressedSender::acquire_slot()
+{
+    while(m_credits == 0 || m_free_slots.empty())
+    {
+        process_completion(m_conn.wait_event());
+    }
+
+    m_credits--;
+
+    const uint32_t slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    return slot;
+}
+
+uint32_t RdmaCompressedSender::encode_chunk(const uint8_t* in, uint32_t size, uint8_t* out, RdmaCodec& codec)
+{
+    // Compressing is only worth it if the chunk gets smaller
+    const size_t capacity = size > 0 ? size - 1 : 0;
+
+    if(m_chunks_since_probe >= probe_interval)
+    {
+        m_chunks_since_probe = 0;
+
+        // Try all the codecs, and keep the best one until the next probe
+        size_t best_sz = 0;
+        m_codec = RdmaCodec::Raw;
+
+        for(RdmaCodec candidate : {RdmaCodec::ZeroRun, RdmaCodec::DeltaZeroRun})
+        {
+            const size_t encoded_sz = encode(candidate, in, size, out, capacity, m_scratch.data());
+            if(encoded_sz != 0 && (best_sz == 0 || encoded_sz < best_sz))
+            {
+                best_sz = encoded_sz;
+                m_codec = candidate;
+            }
+        }
+
+        // The output of the best codec may have been overwritten by another one
+        if(m_codec != RdmaCodec::DeltaZeroRun && m_codec != RdmaCodec::Raw)
+        {
+            encode(m_codec, in, size, out, capacity, m_scratch.data());
+        }
+
+        if(m_codec != RdmaCodec::Raw)
+        {
+            codec = m_codec;
+            return static_cast<uint32_t>(best_sz);
+        }
+    }
+    else
+    {
+        m_chunks_since_probe++;
+
+        if(m_codec != RdmaCodec::Raw)
+        {
+            const size_t encoded_sz = encode(m_codec, in, size, out, capacity, m_scratch.data());
+            if(encoded_sz != 0)
+            {
+                codec = m_codec;
+                return static_cast<uint32_t>(encoded_sz);
+            }
+
+            // The data changed, do not waste CPU on it until the next probe
+            m_codec = RdmaCodec::Raw;
+        }
+    }
+
+    codec = RdmaCodec::Raw;
+    std::memcpy(out, in, size);
+    return size;
+}
+
+void RdmaCompressedSender::send(const void* data, size_t size)
+{
+    const auto* in = static_cast<const uint8_t*>(data);
+    size_t offset = 0;
+
+    // Even an empty message has a chunk, so the receiver sees it
+    do
+    {
+        const uint32_t raw_sz = static_cast<uint32_t>(std::min<size_t>(m_chunk_sz, size - offset));
+        const uint32_t slot = acquire_slot();
+        const Buffer buf = send_slot(slot);
+
+        // Encoding this chunk overlaps with the sending of the previous ones
+        RdmaCodec codec = RdmaCodec::Raw;
+        const uint32_t encoded_sz = encode_chunk(in + offset, raw_sz, buf.data + sizeof(RdmaChunkHeader), codec);
+
+        RdmaChunkHeader header{};
+        header.total_size = size;
+        header.raw_size = raw_sz;
+        header.codec = static_cast<uint16_t>(codec);
+        std::memcpy(buf.data, &header, sizeof(header));
+
+        const uint32_t wire_sz = static_cast<uint32_t>(sizeof(header)) + encoded_sz;
+        m_conn.post_send(Buffer{buf.data, wire_sz}, slot);
+
+        m_raw_bytes += raw_sz;
+        m_wire_bytes += wire_sz;
+        offset += raw_sz;
+    } while(offset < size);
+}
+
+RdmaCompressedReceiver::RdmaCompressedReceiver(RdmaBase& conn, uint32_t chunk_size, uint32_t num_slots)
+    : m_conn(conn),
+      m_chunk_sz(chunk_size),
+      m_num_slots(num_slots)
+{
+    check_slots(conn, chunk_size, num_slots);
+
+    const uint64_t slots_sz = static_cast<uint64_t>(sizeof(RdmaChunkHeader) + chunk_size) * num_slots;
+    if(conn.get_recv_buf().size < slots_sz || conn.get_send_buf().size < credit_sz * num_slots)
+    {
+        THROW_ERROR("Buffers are too small for %u chunks of %u bytes", num_slots, chunk_size);
+    }
+
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        m_conn.post_receive(recv_slot(i), i);
+    }
+}
+
+RdmaCompressedReceiver::Buffer RdmaCompressedReceiver::recv_slot(uint32_t i)
+{
+    const uint32_t slot_sz = static_cast<uint32_t>(sizeof(RdmaChunkHeader)) + m_chunk_sz;
+    return {m_conn.get_recv_buf().data + static_cast<size_t>(i) * slot_sz, slot_sz};
+}
+
+RdmaCompressedReceiver::Buffer RdmaCompressedReceiver::credit_slot(uint32_t i)
+{
+    return {m_conn.get_send_buf().data + i * credit_sz, credit_sz};
+}
+
+size_t RdmaCompressedReceiver::receive(void* data, size_t capacity)
+{
+    auto* out = static_cast<uint8_t*>(data);
+    size_t received = 0;
+    uint64_t total_sz = 0;
+    bool first = true;
+
+    while(first || received < total_sz)
+    {
+        const ibv_wc wc = m_conn.wait_event();
+
+        // The completions of the credits
+        if(wc.opcode == IBV_WC_SEND)
+        {
+            continue;
+        }
+
+        if(!(wc.opcode & IBV_WC_RECV))
+        {
+            THROW_ERROR("Unexpected completion opcode %d in compressed stream", static_cast<int>(wc.opcode));
+        }
+
+        const uint32_t slot = static_cast<uint32_t>(wc.wr_id);
+        const Buffer buf = recv_slot(slot);
+
+        RdmaChunkHeader header;
+        if(wc.byte_len < sizeof(header))
+        {
+            THROW_ERROR("Compressed chunk of %u bytes is too small", wc.byte_len);
+        }
+        std::memcpy(&header, buf.data, sizeof(header));
+
+        if(first)
+        {
+            total_sz = header.total_size;
+            first = false;
+
+            if(total_sz > capacity)
+            {
+                THROW_ERROR("Message of %llu bytes does not fit in %zu bytes",
+                            static_cast<unsigned long long>(total_sz), capacity);
+            }
+        }
+
+        if(header.total_size != total_sz || header.raw_size > total_sz - received || header.raw_size > m_chunk_sz)
+        {
+            THROW_ERROR("Corrupted compressed chunk header");
+        }
+
+        const uint8_t* payload = buf.data + sizeof(header);
+        const size_t payload_sz = wc.byte_len - sizeof(header);
+
+        switch(static_cast<RdmaCodec>(header.codec))
+        {
+            case RdmaCodec::Raw:
+                if(payload_sz != header.raw_size)
+                {
+                    THROW_ERROR("Corrupted raw chunk");
+                }
+                std::memcpy(out + received, payload, payload_sz);
+                break;
+
+            case RdmaCodec::ZeroRun:
+                zero_run_decode(payload, payload_sz, out + received, header.raw_size);
+                break;
+
+            case RdmaCodec::DeltaZeroRun:
+                zero_run_decode(payload, payload_sz, out + received, header.raw_size);
+                delta_decode(out + received, header.raw_size);
+                break;
+
+            default:
+                THROW_ERROR("Unknown codec %u", header.codec);
+        }
+
+        received += header.raw_size;
+
+        // The slot is free again: repost it before giving the credit back
+        m_conn.post_receive(buf, slot);
+
+        const Buffer credit = credit_slot(slot);
+        std::memcpy(credit.data, &slot, credit_sz);
+        m_conn.post_send(credit, slot);
+    }
+
+    return static_cast<size_t>(total_sz);
+}
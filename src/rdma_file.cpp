@@ -0,0 +1,452 @@
+#include "rdma_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+/**
+ * A file mapped in memory, unmapped when destroyed.
+ */
+class MappedFile
+{
+public:
+    // Open an existing file for reading
+    explicit MappedFile(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        HTHROW_ERRNO(fd >= 0);
+
+        struct stat st{};
+        if(fstat(fd, &st) != 0)
+        {
+            close(fd);
+            HTHROW_ERRNO(false);
+        }
+
+        map(fd, static_cast<uint64_t>(st.st_size), PROT_READ);
+    }
+
+    // Create or truncate a file of `size` bytes for writing
+    MappedFile(const std::string& path, uint64_t size)
+    {
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        HTHROW_ERRNO(fd >= 0);
+
+        if(ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            close(fd);
+            HTHROW_ERRNO(false);
+        }
+
+        map(fd, size, PROT_READ | PROT_WRITE);
+    }
+
+    ~MappedFile()
+    {
+        if(m_data)
+        {
+            HENSURE_ERRNO(munmap(m_data, m_size) == 0);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    uint8_t* data() const
+    {
+        return m_data;
+    }
+
+    uint64_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    // The mapping stays valid once the file is closed
+    void map(int fd, uint64_t size, int prot)
+    {
+        m_size = size;
+
+        // mmap() does not accept empty mappings
+        if(size > 0)
+        {
+            void* const data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+            const int mmap_errno = errno;
+            close(fd);
+
+            errno = mmap_errno;
+            HTHROW_ERRNO(data != MAP_FAILED);
+
+            m_data = static_cast<uint8_t*>(data);
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+
+    uint8_t* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+}
+
+RdmaFileStream::RdmaFileStream(RdmaBase& conn)
+    : m_conn(conn)
+{
+    const RdmaOptions& options = conn.get_options();
+
+    if(options.prepost_receive)
+    {
+        THROW_ERROR("File transfer connections should be created with RdmaOptions::prepost_receive disabled");
+    }
+
+    if(options.max_recv_wr < num_control_slots || options.max_send_wr <= num_control_slots)
+    {
+        THROW_ERROR("File transfers need more than %u send and receive work requests", num_control_slots);
+    }
+
+    const uint32_t slots_sz = num_control_slots * static_cast<uint32_t>(sizeof(RdmaFileControl));
+    if(conn.get_send_buf().size < slots_sz || conn.get_recv_buf().size < slots_sz)
+    {
+        THROW_ERROR("File transfers need buffers of at least %u bytes", slots_sz);
+    }
+
+    for(uint32_t i = 0; i < num_control_slots; i++)
+    {
+        m_free_send_slots.push_back(i);
+        m_conn.post_receive(recv_slot(i), i);
+    }
+}
+
+RdmaFileStream::Buffer RdmaFileStream::send_slot(uint32_t i)
+{
+    return {m_conn.get_send_buf().data + i * sizeof(RdmaFileControl), sizeof(RdmaFileControl)};
+}
+
+RdmaFileStream::Buffer RdmaFileStream::recv_slot(uint32_t i)
+{
+    return {m_conn.get_recv_buf().data + i * sizeof(RdmaFileControl), sizeof(RdmaFileControl)};
+}
+
+void RdmaFileStream::post_control(const RdmaFileControl& msg)
+{
+    while(m_free_send_slots.empty())
+    {
+        process_one_completion();
+    }
+
+    const uint32_t slot = m_free_send_slots.back();
+    m_free_send_slots.pop_back();
+
+    const Buffer buf = send_slot(slot);
+    std::memcpy(buf.data, &msg, sizeof(msg));
+    m_conn.post_send(buf, slot);
+}
+
+bool RdmaFileStream::try_pop_control(RdmaFileControl& msg)
+{
+    ibv_wc wc{};
+    while(m_inbox.empty() && m_conn.poll_event(wc))
+    {
+        process_completion(wc);
+    }
+
+    if(m_inbox.empty())
+    {
+        return false;
+    }
+
+    msg = m_inbox.front();
+    m_inbox.pop_front();
+    return true;
+}
+
+RdmaFileControl RdmaFileStream::wait_control(RdmaFileControl::Type expected)
+{
+    while(m_inbox.empty())
+    {
+        process_one_completion();
+    }
+
+    const RdmaFileControl msg = m_inbox.front();
+    m_inbox.pop_front();
+
+    if(msg.type != expected)
+    {
+        THROW_ERROR("Expected file control message %u, got %u", expected, msg.type);
+    }
+
+    return msg;
+}
+
+void RdmaFileStream::wait_sends()
+{
+    while(m_free_send_slots.size() < num_control_slots)
+    {
+        process_one_completion();
+    }
+}
+
+void RdmaFileStream::process_one_completion()
+{
+    process_completion(m_conn.wait_event());
+}
+
+void RdmaFileStream::process_completion(const ibv_wc& wc)
+{
+    if(wc.opcode & IBV_WC_RECV)
+    {
+        const uint32_t slot = static_cast<uint32_t>(wc.wr_id);
+        if(wc.byte_len != sizeof(RdmaFileControl) || slot >= num_control_slots)
+        {
+            THROW_ERROR("Malformed file control message of %u bytes", wc.byte_len);
+        }
+
+        RdmaFileControl msg;
+        std::memcpy(&msg, recv_slot(slot).data, sizeof(msg));
+        m_inbox.push_back(msg);
+
+        m_conn.post_receive(recv_slot(slot), slot);
+    }
+    else if(wc.opcode == IBV_WC_SEND)
+    {
+        m_free_send_slots.push_back(static_cast<uint32_t>(wc.wr_id));
+    }
+    else if(wc.opcode == IBV_WC_RDMA_WRITE)
+    {
+        m_writes_in_flight--;
+    }
+    else
+    {
+        THROW_ERROR("Unexpected completion opcode %d in file transfer", static_cast<int>(wc.opcode));
+    }
+}
+
+RdmaFileSender::RdmaFileSender(RdmaBase& conn, uint32_t chunk_size)
+    : RdmaFileStream(conn),
+      m_chunk_sz(chunk_size)
+{
+    if(chunk_size == 0)
+    {
+        THROW_ERROR("Invalid chunk size");
+    }
+
+    // The control messages share the send queue of the first QP
+    m_max_writes_in_flight = conn.get_options().max_send_wr - num_control_slots;
+}
+
+ibv_mr* RdmaFileSender::register_window(uint8_t* file_data, const RdmaFileControl& grant)
+{
+    if(m_file_mr)
+    {
+        return m_file_mr;
+    }
+
+    // The NIC only reads the source
+    return m_conn.register_memory(file_data + grant.offset, grant.size, 0);
+}
+
+void RdmaFileSender::deregister_window(ibv_mr* mr)
+{
+    if(mr != m_file_mr)
+    {
+        m_conn.deregister_memory(mr);
+    }
+}
+
+void RdmaFileSender::post_window(uint8_t* file_data, const RdmaFileControl& grant, bool has_next,
+                                 RdmaFileControl& next_grant, ibv_mr*& next_mr)
+{
+    for(uint64_t offset = 0; offset < grant.size; offset += m_chunk_sz)
+    {
+        while(m_writes_in_flight >= m_max_writes_in_flight)
+        {
+            // The send queue is full: use the time to register the next window, if it is granted already
+            if(has_next && !next_mr && try_pop_control(next_grant))
+            {
+                if(next_grant.type != RdmaFileControl::GRANT)
+                {
+                    THROW_ERROR("Expected a window grant, got file control message %u", next_grant.type);
+                }
+
+                next_mr = register_window(file_data, next_grant);
+            }
+            else
+            {
+                process_one_completion();
+            }
+        }
+
+        const uint32_t size = static_cast<uint32_t>(std::min<uint64_t>(m_chunk_sz, grant.size - offset));
+        const Buffer chunk{file_data + grant.offset + offset, size};
+
+        m_conn.post_write(chunk, grant.addr + offset, grant.rkey, true, m_conn.select_qp(offset / m_chunk_sz));
+        m_writes_in_flight++;
+    }
+}
+
+void RdmaFileSender::send(const std::string& path)
+{
+    const MappedFile file(path);
+    uint8_t* const data = file.data();
+
+    m_file_mr = nullptr;
+
+    if(file.size() > 0)
+    {
+        // The pages are read once, in order
+        madvise(data, file.size(), MADV_SEQUENTIAL);
+
+        if(m_conn.supports_on_demand_paging(IBV_ODP_SUPPORT_WRITE))
+        {
+            m_file_mr = m_conn.register_memory(data, file.size(), IBV_ACCESS_ON_DEMAND);
+        }
+    }
+
+    post_control({RdmaFileControl::BEGIN, 0, 0, file.size(), 0, 0, 0});
+
+    if(file.size() > 0)
+    {
+        RdmaFileControl grant = wait_control(RdmaFileControl::GRANT);
+        ibv_mr* mr = register_window(data, grant);
+
+        while(true)
+        {
+            const bool last = grant.offset + grant.size >= file.size();
+
+            RdmaFileControl next_grant{};
+            ibv_mr* next_mr = nullptr;
+            post_window(data, grant, !last, next_grant, next_mr);
+
+            // The writes of this window are in flight, register the next one meanwhile
+            if(!last && !next_mr)
+            {
+                next_grant = wait_control(RdmaFileControl::GRANT);
+                next_mr = register_window(data, next_grant);
+            }
+
+            while(m_writes_in_flight > 0)
+            {
+                process_one_completion();
+            }
+
+            deregister_window(mr);
+            post_control({RdmaFileControl::DONE, grant.window, grant.offset, grant.size, 0, 0, 0});
+
+            if(last)
+            {
+                break;
+            }
+
+            grant = next_grant;
+            mr = next_mr;
+        }
+    }
+
+    post_control({RdmaFileControl::END, 0, 0, file.size(), 0, 0, 0});
+    wait_control(RdmaFileControl::ACK);
+    wait_sends();
+
+    if(m_file_mr)
+    {
+        m_conn.deregister_memory(m_file_mr);
+        m_file_mr = nullptr;
+    }
+}
+
+RdmaFileReceiver::RdmaFileReceiver(RdmaBase& conn, uint64_t window_size)
+    : RdmaFileStream(conn),
+      m_window_sz(window_size)
+{
+    if(window_size == 0)
+    {
+        THROW_ERROR("Invalid window size");
+    }
+}
+
+void RdmaFileReceiver::grant_window(uint8_t* file_data, uint64_t file_sz, uint32_t window)
+{
+    const uint64_t offset = window * m_window_sz;
+    const uint64_t size = std::min(m_window_sz, file_sz - offset);
+
+    ibv_mr* const mr = m_file_mr ? m_file_mr
+                                 : m_conn.register_memory(file_data + offset, size,
+                                                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    m_window_mrs[window % 2] = mr;
+
+    post_control({RdmaFileControl::GRANT, window, offset, size,
+                  reinterpret_cast<uint64_t>(file_data + offset), mr->rkey, 0});
+}
+
+uint64_t RdmaFileReceiver::receive(const std::string& path)
+{
+    const RdmaFileControl begin = wait_control(RdmaFileControl::BEGIN);
+    const uint64_t file_sz = begin.size;
+
+    const MappedFile file(path, file_sz);
+    uint8_t* const data = file.data();
+
+    m_file_mr = nullptr;
+
+    if(file_sz > 0)
+    {
+        if(m_conn.supports_on_demand_paging(IBV_ODP_SUPPORT_WRITE))
+        {
+            m_file_mr = m_conn.register_memory(data, file_sz, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE
+                                                              | IBV_ACCESS_ON_DEMAND);
+        }
+
+        const uint64_t num_windows = (file_sz + m_window_sz - 1) / m_window_sz;
+        if(num_windows > UINT32_MAX)
+        {
+            THROW_ERROR("File of %llu bytes has too many windows", static_cast<unsigned long long>(file_sz));
+        }
+
+        // Double buffering: the sender always has the next window when it finishes the current one
+        for(uint32_t i = 0; i < std::min<uint64_t>(2, num_windows); i++)
+        {
+            grant_window(data, file_sz, i);
+        }
+
+        for(uint64_t done = 0; done < num_windows; done++)
+        {
+            const RdmaFileControl msg = wait_control(RdmaFileControl::DONE);
+
+            ibv_mr*& mr = m_window_mrs[msg.window % 2];
+            if(msg.window != done || !mr)
+            {
+                THROW_ERROR("Unexpected completion of window %u", msg.window);
+            }
+
+            if(mr != m_file_mr)
+            {
+                m_conn.deregister_memory(mr);
+            }
+            mr = nullptr;
+
+            if(msg.window + 2 < num_windows)
+            {
+                grant_window(data, file_sz, msg.window + 2);
+            }
+        }
+
+        if(m_file_mr)
+        {
+            m_conn.deregister_memory(m_file_mr);
+            m_file_mr = nullptr;
+        }
+    }
+
+    wait_control(RdmaFileControl::END);
+    post_control({RdmaFileControl::ACK, 0, 0, file_sz, 0, 0, 0});
+    wait_sends();
+
+    return file_sz;
+}
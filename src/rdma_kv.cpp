@@ -0,0 +1,418 @@
+#include "rdma_kv.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace
+{
+
+enum KvOp : uint32_t
+{
+    KV_PUT = 1,
+    KV_ERASE = 2
+};
+
+enum KvStatus : uint32_t
+{
+    KV_OK = 0,
+    KV_NOT_FOUND = 1,
+    KV_FULL = 2,
+    KV_BAD_REQUEST = 3
+};
+
+struct KvRequest
+{
+    uint32_t op;
+    uint32_t value_size;
+    uint64_t key;
+    // Followed by the value for KV_PUT
+};
+
+struct KvResponse
+{
+    uint32_t status;
+};
+
+// A torn read is retried, but a server stuck in the middle of an update should not hang the client forever
+const int max_torn_reads = 1'000'000;
+
+uint32_t round_up8(uint32_t x)
+{
+    return (x + 7) / 8 * 8;
+}
+
+// Finalizer of splitmix64, a cheap hash with a good avalanche
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+const uint8_t* value_of(const RdmaKvEntry* entry)
+{
+    return reinterpret_cast<const uint8_t*>(entry + 1);
+}
+
+uint8_t* value_of(RdmaKvEntry* entry)
+{
+    return reinterpret_cast<uint8_t*>(entry + 1);
+}
+
+}
+
+RdmaKvLayout::RdmaKvLayout(uint32_t num_buckets, uint32_t max_value_size)
+    : m_num_buckets(num_buckets),
+      m_max_value_sz(max_value_size)
+{
+    if(num_buckets < 2)
+    {
+        THROW_ERROR("A key-value table needs at least 2 buckets");
+    }
+
+    const uint64_t entry_sz = sizeof(RdmaKvEntry) + round_up8(max_value_size);
+    if(max_value_size == 0 || entry_sz * entries_per_bucket > UINT32_MAX)
+    {
+        THROW_ERROR("Invalid key-value size %u", max_value_size);
+    }
+
+    m_entry_sz = static_cast<uint32_t>(entry_sz);
+}
+
+void RdmaKvLayout::buckets_of(uint64_t key, uint32_t& first, uint32_t& second) const
+{
+    const uint64_t h = mix64(key);
+
+    first = static_cast<uint32_t>(h % m_num_buckets);
+    second = static_cast<uint32_t>(mix64(h ^ 0x9e3779b97f4a7c15ULL) % m_num_buckets);
+
+    if(second == first)
+    {
+        second = (first + 1) % m_num_buckets;
+    }
+}
+
+uint64_t RdmaKvLayout::checksum(const RdmaKvEntry& entry, const uint8_t* value)
+{
+    uint64_t h = mix64(entry.version);
+    h = mix64(h ^ entry.key);
+    h = mix64(h ^ (static_cast<uint64_t>(entry.occupied) << 32 | entry.value_size));
+
+    // The value is read 8 bytes at a time, the padding of the entry is always there
+    for(uint32_t i = 0; i < entry.value_size; i += 8)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, value + i, std::min<uint32_t>(8, entry.value_size - i));
+        h = mix64(h ^ word);
+    }
+
+    return h;
+}
+
+RdmaKvServer::RdmaKvServer(RdmaServer& server, uint32_t num_buckets, uint32_t max_value_size)
+    : m_server(server),
+      m_layout(num_buckets, max_value_size)
+{
+    const size_t table_sz = static_cast<size_t>(m_layout.bucket_size()) * num_buckets;
+    m_table.assign(table_sz / sizeof(uint64_t), 0);
+
+    // Only readable remotely, all updates go through the server CPU
+    m_table_mr = m_server.register_memory(m_table.data(), table_sz, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+
+    RdmaKvDescriptor desc{};
+    desc.addr = reinterpret_cast<uint64_t>(m_table.data());
+    desc.rkey = m_table_mr->rkey;
+    desc.num_buckets = num_buckets;
+    desc.max_value_size = max_value_size;
+    m_server.set_private_data(&desc, sizeof(desc));
+}
+
+RdmaKvServer::~RdmaKvServer()
+{
+    try
+    {
+        m_server.deregister_memory(m_table_mr);
+    }
+    catch(const std::exception& e)
+    {
+        spdlog::error("Failed to deregister the key-value table: {}", e.what());
+    }
+}
+
+RdmaKvEntry* RdmaKvServer::entry(uint32_t bucket, uint32_t i)
+{
+    auto* base = reinterpret_cast<uint8_t*>(m_table.data());
+    const size_t offset = static_cast<size_t>(bucket) * m_layout.bucket_size() + i * m_layout.entry_size();
+
+    return reinterpret_cast<RdmaKvEntry*>(base + offset);
+}
+
+RdmaKvEntry* RdmaKvServer::find(uint64_t key)
+{
+    uint32_t buckets[2];
+    m_layout.buckets_of(key, buckets[0], buckets[1]);
+
+    for(uint32_t bucket : buckets)
+    {
+        for(uint32_t i = 0; i < RdmaKvLayout::entries_per_bucket; i++)
+        {
+            RdmaKvEntry* e = entry(bucket, i);
+            if(e->occupied && e->key == key)
+            {
+                return e;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+void RdmaKvServer::write_entry(RdmaKvEntry* e, uint64_t key, bool occupied, const void* value, uint32_t size)
+{
+    // Odd version: the readers retry until the update is complete.
+    // The fences keep the compiler and the CPU from moving the writes outside of the odd window.
+    e->version++;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    e->key = key;
+    e->occupied = occupied ? 1 : 0;
+    e->value_size = size;
+    if(size > 0)
+    {
+        std::memcpy(value_of(e), value, size);
+    }
+
+    // The checksum is computed with the final version, which is the one the readers check
+    RdmaKvEntry final_entry = *e;
+    final_entry.version++;
+    e->checksum = RdmaKvLayout::checksum(final_entry, value_of(e));
+
+    std::atomic_thread_fence(std::memory_order_release);
+    e->version++;
+}
+
+bool RdmaKvServer::put(uint64_t key, const void* value, uint32_t size)
+{
+    if(size > m_layout.max_value_size())
+    {
+        THROW_ERROR("Value of %u bytes is larger than the maximum %u", size, m_layout.max_value_size());
+    }
+
+    RdmaKvEntry* e = find(key);
+
+    if(!e)
+    {
+        // Insert in the least loaded bucket, to keep both short
+        uint32_t buckets[2];
+        m_layout.buckets_of(key, buckets[0], buckets[1]);
+
+        RdmaKvEntry* free_entries[2] = {nullptr, nullptr};
+        uint32_t num_free[2] = {0, 0};
+
+        for(int b = 0; b < 2; b++)
+        {
+            for(uint32_t i = 0; i < RdmaKvLayout::entries_per_bucket; i++)
+            {
+                RdmaKvEntry* candidate = entry(buckets[b], i);
+                if(!candidate->occupied)
+                {
+                    if(!free_entries[b])
+                    {
+                        free_entries[b] = candidate;
+                    }
+                    num_free[b]++;
+                }
+            }
+        }
+
+        e = num_free[1] > num_free[0] ? free_entries[1] : free_entries[0];
+        if(!e)
+        {
+            return false;
+        }
+    }
+
+    write_entry(e, key, true, value, size);
+    return true;
+}
+
+bool RdmaKvServer::erase(uint64_t key)
+{
+    RdmaKvEntry* e = find(key);
+    if(!e)
+    {
+        return false;
+    }
+
+    write_entry(e, 0, false, nullptr, 0);
+    return true;
+}
+
+void RdmaKvServer::handle_message(uint32_t request_sz, uint32_t& response_sz)
+{
+    const RdmaBase::Buffer request_buf = m_server.get_recv_buf();
+    const RdmaBase::Buffer response_buf = m_server.get_send_buf();
+
+    KvRequest request{};
+    KvResponse response{KV_BAD_REQUEST};
+
+    if(request_sz >= sizeof(request))
+    {
+        std::memcpy(&request, request_buf.data, sizeof(request));
+
+        if(request.op == KV_PUT && request.value_size <= request_sz - sizeof(request)
+           && request.value_size <= m_layout.max_value_size())
+        {
+            response.status = put(request.key, request_buf.data + sizeof(request), request.value_size) ? KV_OK
+                                                                                                       : KV_FULL;
+        }
+        else if(request.op == KV_ERASE)
+        {
+            response.status = erase(request.key) ? KV_OK : KV_NOT_FOUND;
+        }
+    }
+
+    std::memcpy(response_buf.data, &response, sizeof(response));
+    response_sz = sizeof(response);
+}
+
+RdmaKvClient::RdmaKvClient(RdmaBase& conn, const Buffer& scratch)
+    : m_conn(conn),
+      m_scratch(scratch)
+{
+    const std::vector<uint8_t>& private_data = conn.get_peer_private_data();
+    if(private_data.size() < sizeof(m_desc))
+    {
+        THROW_ERROR("The server did not publish a key-value table");
+    }
+
+    std::memcpy(&m_desc, private_data.data(), sizeof(m_desc));
+    m_layout = RdmaKvLayout(m_desc.num_buckets, m_desc.max_value_size);
+
+    if(scratch.size < m_layout.bucket_size())
+    {
+        THROW_ERROR("The scratch buffer should hold a bucket of %u bytes", m_layout.bucket_size());
+    }
+}
+
+RdmaKvClient::Lookup RdmaKvClient::lookup_bucket(uint32_t bucket, uint64_t key, void* value, uint32_t& size)
+{
+    const uint64_t addr = m_desc.addr + static_cast<uint64_t>(bucket) * m_layout.bucket_size();
+
+    m_conn.post_read(Buffer{m_scratch.data, m_layout.bucket_size()}, addr, m_desc.rkey);
+    m_conn.wait_for_read();
+
+    Lookup result = Lookup::NotFound;
+
+    for(uint32_t i = 0; i < RdmaKvLayout::entries_per_bucket; i++)
+    {
+        const auto* entry = reinterpret_cast<const RdmaKvEntry*>(m_scratch.data + i * m_layout.entry_size());
+        const uint8_t* entry_value = value_of(entry);
+
+        RdmaKvEntry e;
+        std::memcpy(&e, entry, sizeof(e));
+
+        // Any entry being modified may be our key, the whole bucket is read again
+        if(e.version % 2 != 0 || e.value_size > m_layout.max_value_size()
+           || RdmaKvLayout::checksum(e, entry_value) != e.checksum)
+        {
+            // A never written entry is all zeroes and has no valid checksum
+            if(e.version != 0)
+            {
+                result = Lookup::Torn;
+            }
+            continue;
+        }
+
+        if(e.occupied && e.key == key)
+        {
+            if(e.value_size > size)
+            {
+                THROW_ERROR("Value of %u bytes does not fit in %u bytes", e.value_size, size);
+            }
+
+            std::memcpy(value, entry_value, e.value_size);
+            size = e.value_size;
+            return Lookup::Found;
+        }
+    }
+
+    return result;
+}
+
+bool RdmaKvClient::get(uint64_t key, void* value, uint32_t& size)
+{
+    uint32_t buckets[2];
+    m_layout.buckets_of(key, buckets[0], buckets[1]);
+
+    for(uint32_t bucket : buckets)
+    {
+        for(int attempt = 0;; attempt++)
+        {
+            const Lookup result = lookup_bucket(bucket, key, value, size);
+
+            if(result == Lookup::Found)
+            {
+                return true;
+            }
+            else if(result == Lookup::NotFound)
+            {
+                break;
+            }
+            else if(attempt == max_torn_reads)
+            {
+                THROW_ERROR("Bucket %u is still being modified after %d reads", bucket, max_torn_reads);
+            }
+        }
+    }
+
+    return false;
+}
+
+bool RdmaKvClient::put(uint64_t key, const void* value, uint32_t size)
+{
+    if(size > m_layout.max_value_size())
+    {
+        THROW_ERROR("Value of %u bytes is larger than the maximum %u", size, m_layout.max_value_size());
+    }
+
+    const Buffer request_buf = m_conn.get_send_buf();
+    if(request_buf.size < sizeof(KvRequest) + size)
+    {
+        THROW_ERROR("Sending buffer is too small for a value of %u bytes", size);
+    }
+
+    const KvRequest request{KV_PUT, size, key};
+    std::memcpy(request_buf.data, &request, sizeof(request));
+    std::memcpy(request_buf.data + sizeof(request), value, size);
+
+    KvResponse response{};
+    std::memcpy(&response, m_conn.msg_send(sizeof(request) + size).data, sizeof(response));
+
+    if(response.status == KV_BAD_REQUEST)
+    {
+        THROW_ERROR("The key-value server rejected the request");
+    }
+
+    return response.status == KV_OK;
+}
+
+bool RdmaKvClient::erase(uint64_t key)
+{
+    const KvRequest request{KV_ERASE, 0, key};
+    std::memcpy(m_conn.get_send_buf().data, &request, sizeof(request));
+
+    KvResponse response{};
+    std::memcpy(&response, m_conn.msg_send(sizeof(request)).data, sizeof(response));
+
+    if(response.status == KV_BAD_REQUEST)
+    {
+        THROW_ERROR("The key-value server rejected the request");
+    }
+
+    return response.status == KV_OK;
+}
@@ -0,0 +1,313 @@
+#include "rdma_pool.h"
+#include <sys/mman.h>
+#include <algorithm>
+
+namespace
+{
+
+// A thread cache holds at most this many bytes per class, and at most `max_cached_blocks` blocks
+const size_t cache_bytes = 1 << 20;
+const size_t max_cached_blocks = 64;
+
+bool is_power_of_two(uint32_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+}
+
+struct RdmaBufferPool::Slab
+{
+    uint8_t* data;
+    size_t size;
+
+    // One region per attached connection
+    std::vector<ibv_mr*> mrs;
+};
+
+struct RdmaBufferPool::Central
+{
+    struct SizeClass
+    {
+        std::mutex mutex;
+        std::vector<Block> free;
+    };
+
+    explicit Central(uint16_t num_classes)
+        : classes(new SizeClass[num_classes])
+    {
+    }
+
+    // Move the last `count` blocks of `blocks` to the free list of their class
+    void give_back(uint16_t size_class, std::vector<Block>& blocks, size_t count)
+    {
+        SizeClass& sc = classes[size_class];
+        std::lock_guard<std::mutex> lock(sc.mutex);
+
+        sc.free.insert(sc.free.end(), blocks.end() - static_cast<ptrdiff_t>(count), blocks.end());
+        blocks.resize(blocks.size() - count);
+    }
+
+    std::unique_ptr<SizeClass[]> classes;
+};
+
+RdmaBufferPool::RdmaBufferPool(RdmaBase& conn, uint32_t min_block_size, uint32_t max_block_size, size_t slab_size,
+                               int access)
+    : m_min_block_size(min_block_size),
+      m_max_block_size(max_block_size),
+      m_slab_size(slab_size),
+      m_access(access)
+{
+    if(!is_power_of_two(min_block_size) || !is_power_of_two(max_block_size) || min_block_size > max_block_size)
+    {
+        THROW_ERROR("RdmaBufferPool: invalid block sizes %u and %u, they should be powers of two",
+                    min_block_size, max_block_size);
+    }
+
+    m_min_shift = static_cast<unsigned int>(__builtin_ctz(min_block_size));
+    m_num_classes = static_cast<uint16_t>(__builtin_ctz(max_block_size) - __builtin_ctz(min_block_size) + 1);
+    m_central = std::make_shared<Central>(m_num_classes);
+
+    attach(conn);
+}
+
+RdmaBufferPool::~RdmaBufferPool()
+{
+    // The thread caches see the pool is gone and drop their blocks
+    m_central.reset();
+
+    for(const std::unique_ptr<Slab>& slab : m_slabs)
+    {
+        for(ibv_mr* mr : slab->mrs)
+        {
+            HENSURE_ERRNO(ibv_dereg_mr(mr) == 0);
+        }
+
+        HENSURE_ERRNO(munmap(slab->data, slab->size) == 0);
+    }
+}
+
+void RdmaBufferPool::attach(RdmaBase& conn)
+{
+    ibv_pd* const pd = conn.get_protection_domain();
+
+    std::lock_guard<std::mutex> lock(m_slabs_mutex);
+
+    if(std::find(m_conns.begin(), m_conns.end(), &conn) != m_conns.end())
+    {
+        THROW_ERROR("attach(): the connection is already attached");
+    }
+
+    size_t num_registered = 0;
+
+    try
+    {
+        for(const std::unique_ptr<Slab>& slab : m_slabs)
+        {
+            ibv_mr* const mr = ibv_reg_mr(pd, slab->data, slab->size, m_access);
+            HTHROW_ERRNO(mr != nullptr);
+
+            slab->mrs.push_back(mr);
+            num_registered++;
+        }
+    }
+    catch(...)
+    {
+        for(size_t i = 0; i < num_registered; i++)
+        {
+            HENSURE_ERRNO(ibv_dereg_mr(m_slabs[i]->mrs.back()) == 0);
+            m_slabs[i]->mrs.pop_back();
+        }
+        throw;
+    }
+
+    m_conns.push_back(&conn);
+}
+
+RdmaBufferPool::Block RdmaBufferPool::acquire(uint32_t size)
+{
+    if(size > m_max_block_size)
+    {
+        THROW_ERROR("acquire(): %u bytes is larger than the largest block of %u bytes", size, m_max_block_size);
+    }
+
+    const uint16_t size_class = size <= m_min_block_size
+                                ? 0
+                                : static_cast<uint16_t>(32 - __builtin_clz(size - 1) - m_min_shift);
+
+    std::vector<Block>& cache = thread_cache(size_class);
+
+    if(cache.empty())
+    {
+        refill(size_class, cache, std::max<size_t>(1, cache_limit(size_class) / 2));
+    }
+
+    const Block block = cache.back();
+    cache.pop_back();
+    return block;
+}
+
+void RdmaBufferPool::release(const Block& block)
+{
+    std::vector<Block>& cache = thread_cache(block.size_class);
+    cache.push_back(block);
+
+    // Keep half of the cache, so the next releases do not lock either
+    const size_t limit = cache_limit(block.size_class);
+    if(cache.size() > limit)
+    {
+        m_central->give_back(block.size_class, cache, cache.size() - limit / 2);
+    }
+}
+
+uint32_t RdmaBufferPool::lkey(const Block& block, const RdmaBase& conn) const
+{
+    for(size_t i = 0; i < m_conns.size(); i++)
+    {
+        if(m_conns[i] == &conn)
+        {
+            return block.slab->mrs[i]->lkey;
+        }
+    }
+
+    THROW_ERROR("lkey(): the connection is not attached to the pool");
+}
+
+size_t RdmaBufferPool::registered_bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_slabs_mutex);
+
+    size_t total = 0;
+    for(const std::unique_ptr<Slab>& slab : m_slabs)
+    {
+        total += slab->size;
+    }
+
+    return total;
+}
+
+std::vector<RdmaBufferPool::Block>& RdmaBufferPool::thread_cache(uint16_t size_class)
+{
+    struct Entry
+    {
+        Central* central;
+        std::weak_ptr<Central> owner;
+        std::vector<std::vector<Block>> classes;
+    };
+
+    // Give the cached blocks back when the thread exits, if their pool still exists
+    struct Caches
+    {
+        ~Caches()
+        {
+            for(Entry& entry : entries)
+            {
+                if(const std::shared_ptr<Central> central = entry.owner.lock())
+                {
+                    for(size_t i = 0; i < entry.classes.size(); i++)
+                    {
+                        central->give_back(static_cast<uint16_t>(i), entry.classes[i], entry.classes[i].size());
+                    }
+                }
+            }
+        }
+
+        std::vector<Entry> entries;
+    };
+
+    thread_local Caches caches;
+
+    for(size_t i = 0; i < caches.entries.size();)
+    {
+        Entry& entry = caches.entries[i];
+
+        // A destroyed pool, even if a new one has the same address
+        if(entry.owner.expired())
+        {
+            caches.entries.erase(caches.entries.begin() + static_cast<ptrdiff_t>(i));
+            continue;
+        }
+
+        if(entry.central == m_central.get())
+        {
+            return entry.classes[size_class];
+        }
+
+        i++;
+    }
+
+    caches.entries.push_back(Entry{m_central.get(), m_central, std::vector<std::vector<Block>>(m_num_classes)});
+    return caches.entries.back().classes[size_class];
+}
+
+size_t RdmaBufferPool::cache_limit(uint16_t size_class) const
+{
+    const size_t block_size = static_cast<size_t>(m_min_block_size) << size_class;
+    return std::min(max_cached_blocks, std::max<size_t>(2, cache_bytes / block_size));
+}
+
+void RdmaBufferPool::refill(uint16_t size_class, std::vector<Block>& out, size_t count)
+{
+    Central::SizeClass& sc = m_central->classes[size_class];
+    std::lock_guard<std::mutex> lock(sc.mutex);
+
+    if(sc.free.empty())
+    {
+        grow(size_class);
+    }
+
+    count = std::min(count, sc.free.size());
+    out.insert(out.end(), sc.free.end() - static_cast<ptrdiff_t>(count), sc.free.end());
+    sc.free.resize(sc.free.size() - count);
+}
+
+void RdmaBufferPool::grow(uint16_t size_class)
+{
+    const size_t block_size = static_cast<size_t>(m_min_block_size) << size_class;
+    const size_t num_blocks = std::max<size_t>(1, m_slab_size / block_size);
+
+    std::unique_ptr<Slab> slab(new Slab{nullptr, num_blocks * block_size, {}});
+
+    void* const data = mmap(nullptr, slab->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    HTHROW_ERRNO(data != MAP_FAILED);
+    slab->data = static_cast<uint8_t*>(data);
+
+    std::lock_guard<std::mutex> lock(m_slabs_mutex);
+
+    try
+    {
+        for(RdmaBase* conn : m_conns)
+        {
+            ibv_mr* const mr = ibv_reg_mr(conn->get_protection_domain(), slab->data, slab->size, m_access);
+            HTHROW_ERRNO(mr != nullptr);
+
+            slab->mrs.push_back(mr);
+        }
+    }
+    catch(...)
+    {
+        for(ibv_mr* mr : slab->mrs)
+        {
+            HENSURE_ERRNO(ibv_dereg_mr(mr) == 0);
+        }
+        HENSURE_ERRNO(munmap(slab->data, slab->size) == 0);
+        throw;
+    }
+
+    std::vector<Block>& free = m_central->classes[size_class].free;
+    free.reserve(free.size() + num_blocks);
+
+    for(size_t i = 0; i < num_blocks; i++)
+    {
+        Block block;
+        block.data = slab->data + i * block_size;
+        block.capacity = static_cast<uint32_t>(block_size);
+        block.lkey = slab->mrs.front()->lkey;
+        block.size_class = size_class;
+        block.slab = slab.get();
+
+        free.push_back(block);
+    }
+
+    m_slabs.push_back(std::move(slab));
+}
@@ -0,0 +1,212 @@
+#include "rdma_rails.h"
+#include "rdma_client.h"
+#include "rdma_server.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+
+namespace
+{
+
+// Chunks are aligned to a cache line so each rail reads/writes whole lines
+const uint32_t stripe_alignment = 64;
+
+}
+
+RdmaRails::RdmaRails(std::vector<std::unique_ptr<RdmaBase>> rails)
+{
+    if(rails.empty())
+    {
+        THROW_ERROR("RdmaRails needs at least one rail");
+    }
+
+    m_rails.resize(rails.size());
+    for(size_t i = 0; i < rails.size(); i++)
+    {
+        m_rails[i].conn = std::move(rails[i]);
+    }
+}
+
+RdmaRails RdmaRails::connect(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::vector<Endpoint>& endpoints,
+                             const RdmaOptions& options)
+{
+    std::vector<std::unique_ptr<RdmaBase>> rails;
+
+    for(const Endpoint& endpoint : endpoints)
+    {
+        rails.push_back(std::make_unique<RdmaClient>(send_buf_sz, recv_buf_sz,
+                                                     endpoint.addr, endpoint.port, endpoint.local_addr, options));
+    }
+
+    return RdmaRails(std::move(rails));
+}
+
+RdmaRails RdmaRails::listen(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::vector<Endpoint>& endpoints,
+                            const RdmaOptions& options)
+{
+    std::vector<std::unique_ptr<RdmaBase>> rails;
+
+    for(const Endpoint& endpoint : endpoints)
+    {
+        rails.push_back(std::make_unique<RdmaServer>(send_buf_sz, recv_buf_sz, endpoint.addr, endpoint.port, options));
+    }
+
+    return RdmaRails(std::move(rails));
+}
+
+void RdmaRails::wait_until_connected()
+{
+    // Both peers connect the rails in the same order, so this can be sequential
+    for(size_t i = 0; i < m_rails.size(); i++)
+    {
+        spdlog::info("Connecting rail {}/{}", i + 1, m_rails.size());
+        m_rails[i].conn->wait_until_connected();
+    }
+}
+
+uint32_t RdmaRails::max_striped_size()
+{
+    uint32_t min_buf_sz = UINT32_MAX;
+
+    for(Rail& rail : m_rails)
+    {
+        min_buf_sz = std::min({min_buf_sz, rail.conn->get_send_buf().size, rail.conn->get_recv_buf().size});
+    }
+
+    // The chunk of each rail is aligned, see `stripe_size()`
+    const uint64_t max_sz = static_cast<uint64_t>(min_buf_sz / stripe_alignment * stripe_alignment) * m_rails.size();
+    return static_cast<uint32_t>(std::min<uint64_t>(max_sz, UINT32_MAX));
+}
+
+uint32_t RdmaRails::stripe_size(uint32_t total_sz, size_t i) const
+{
+    const uint64_t num_rails = m_rails.size();
+
+    // Round the chunk up to the alignment, so only the last non-empty chunk is partial
+    uint64_t chunk_sz = (total_sz + num_rails - 1) / num_rails;
+    chunk_sz = (chunk_sz + stripe_alignment - 1) / stripe_alignment * stripe_alignment;
+
+    const uint64_t begin = std::min<uint64_t>(chunk_sz * i, total_sz);
+    const uint64_t end = std::min<uint64_t>(begin + chunk_sz, total_sz);
+
+    return static_cast<uint32_t>(end - begin);
+}
+
+void RdmaRails::scatter(const uint8_t* src, uint32_t size)
+{
+    if(size > max_striped_size())
+    {
+        THROW_ERROR("scatter(): %u bytes do not fit in the rails buffers", size);
+    }
+
+    for(size_t i = 0; i < m_rails.size(); i++)
+    {
+        const uint32_t chunk_sz = stripe_size(size, i);
+        std::memcpy(m_rails[i].conn->get_send_buf().data, src, chunk_sz);
+        src += chunk_sz;
+    }
+}
+
+uint32_t RdmaRails::gather(uint8_t* dst, uint32_t capacity)
+{
+    uint32_t copied = 0;
+
+    for(Rail& rail : m_rails)
+    {
+        const uint32_t chunk_sz = std::min(rail.last_recv_sz, capacity - copied);
+        std::memcpy(dst + copied, rail.conn->get_recv_buf().data, chunk_sz);
+        copied += chunk_sz;
+    }
+
+    return copied;
+}
+
+uint32_t RdmaRails::msg_send(uint32_t request_sz)
+{
+    if(request_sz > max_striped_size())
+    {
+        THROW_ERROR("msg_send(): %u bytes do not fit in the rails buffers", request_sz);
+    }
+
+    // Post everything first so that all the NICs work in parallel
+    for(size_t i = 0; i < m_rails.size(); i++)
+    {
+        m_rails[i].conn->post_receive();
+        m_rails[i].conn->post_send(stripe_size(request_sz, i));
+    }
+
+    uint32_t response_sz = 0;
+    for(Rail& rail : m_rails)
+    {
+        rail.conn->wait_for_1send_1recv(rail.last_recv_sz);
+        response_sz += rail.last_recv_sz;
+    }
+
+    return response_sz;
+}
+
+size_t RdmaRails::select_rail(uint64_t key) const
+{
+    switch(m_policy)
+    {
+        case Policy::Hash:
+        {
+            // Fibonacci hashing, so that consecutive keys are spread
+            const uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+            return static_cast<size_t>((hash >> 32) % m_rails.size());
+        }
+
+        case Policy::LeastLoaded:
+        {
+            const auto it = std::min_element(m_rails.begin(), m_rails.end(), [](const Rail& a, const Rail& b) {
+                return a.in_flight < b.in_flight;
+            });
+
+            return static_cast<size_t>(it - m_rails.begin());
+        }
+    }
+
+    return 0;
+}
+
+void RdmaRails::post_write(size_t i, const Buffer& send_buf, uint64_t remote_addr, uint32_t rkey)
+{
+    m_rails[i].conn->post_write(send_buf, remote_addr, rkey, true);
+    m_rails[i].in_flight++;
+}
+
+size_t RdmaRails::poll_completions()
+{
+    size_t completed = 0;
+
+    for(Rail& rail : m_rails)
+    {
+        ibv_wc wc{};
+        while(rail.in_flight > 0 && rail.conn->poll_event(wc))
+        {
+            // A message completion would be lost, `msg_send`/`msg_recv` should not be in flight at the same time
+            if(wc.opcode != IBV_WC_RDMA_WRITE)
+            {
+                THROW_ERROR("Expected IBV_WC_RDMA_WRITE event, got something different.");
+            }
+
+            rail.in_flight--;
+            completed++;
+        }
+    }
+
+    return completed;
+}
+
+void RdmaRails::wait_all()
+{
+    const auto pending = [this] {
+        return std::any_of(m_rails.begin(), m_rails.end(), [](const Rail& rail) {
+            return rail.in_flight > 0;
+        });
+    };
+
+    while(pending())
+    {
+        poll_completions();
+    }
+}
@@ -0,0 +1,569 @@
+#include "rdma_rpc.h"
+#include "spdlog/spdlog.h"
+
+namespace
+{
+
+// Slots are aligned to a cache line
+const uint32_t slot_alignment = 64;
+
+// How many times an idle worker checks its queue before sleeping
+const int worker_spin_count = 64;
+
+}
+
+RdmaRpcSlots::RdmaRpcSlots(RdmaBase& conn, uint32_t num_slots)
+    : m_conn(conn),
+      m_num_slots(num_slots)
+{
+    if(conn.get_options().prepost_receive)
+    {
+        THROW_ERROR("RPC connections should be created with RdmaOptions::prepost_receive disabled");
+    }
+
+    if(num_slots == 0 || num_slots > conn.get_options().max_recv_wr || num_slots > conn.get_options().max_send_wr)
+    {
+        THROW_ERROR("Invalid number of RPC slots %u for the queue depths", num_slots);
+    }
+
+    const uint32_t buf_sz = std::min(conn.get_send_buf().size, conn.get_recv_buf().size);
+    m_slot_sz = buf_sz / num_slots / slot_alignment * slot_alignment;
+
+    if(m_slot_sz <= sizeof(RpcHeader))
+    {
+        THROW_ERROR("Buffers are too small for %u RPC slots", num_slots);
+    }
+
+    m_free_send_slots.reserve(num_slots);
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        m_free_send_slots.push_back(num_slots - 1 - i);
+    }
+}
+
+RdmaRpcSlots::Buffer RdmaRpcSlots::send_slot(uint32_t i)
+{
+    return {m_conn.get_send_buf().data + static_cast<size_t>(i) * m_slot_sz, m_slot_sz};
+}
+
+RdmaRpcSlots::Buffer RdmaRpcSlots::recv_slot(uint32_t i)
+{
+    return {m_conn.get_recv_buf().data + static_cast<size_t>(i) * m_slot_sz, m_slot_sz};
+}
+
+RdmaRpcSlots::Buffer RdmaRpcSlots::payload(const Buffer& slot, uint32_t size)
+{
+    return {slot.data + sizeof(RpcHeader), size};
+}
+
+void RdmaRpcSlots::post_recv_slot(uint32_t i)
+{
+    m_conn.post_receive(recv_slot(i), i);
+}
+
+void RdmaRpcSlots::post_send_slot(uint32_t i)
+{
+    const Buffer slot = send_slot(i);
+    const auto* header = reinterpret_cast<const RpcHeader*>(slot.data);
+
+    m_conn.post_send(Buffer{slot.data, static_cast<uint32_t>(sizeof(RpcHeader)) + header->size}, i);
+}
+
+uint32_t RdmaRpcSlots::acquire_send_slot()
+{
+    ibv_wc wc{};
+    while(m_free_send_slots.empty())
+    {
+        wc = m_conn.wait_event();
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+
+    const uint32_t slot = m_free_send_slots.back();
+    m_free_send_slots.pop_back();
+    return slot;
+}
+
+RdmaRpcServer::RdmaRpcServer(RdmaBase& conn, uint32_t num_slots)
+    : RdmaRpcSlots(conn, num_slots)
+{
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        post_recv_slot(i);
+    }
+}
+
+RdmaRpcServer::~RdmaRpcServer()
+{
+    if(m_workers.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        stop_workers();
+    }
+    catch(const std::exception& e)
+    {
+        spdlog::error("Failed to stop the RPC workers: {}", e.what());
+
+        // The completions can not be drained anymore, the workers waiting for a send slot would never get one
+        m_aborting = true;
+        wake_all();
+
+        for(std::thread& worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+}
+
+void RdmaRpcServer::register_handler(uint16_t method, Handler handler, uint32_t min_request_size)
+{
+    m_handlers[method] = Method{std::move(handler), min_request_size};
+}
+
+int RdmaRpcServer::poll()
+{
+    rethrow_worker_error();
+    m_num_processed = 0;
+
+    ibv_wc wc{};
+    while(m_conn.poll_event(wc))
+    {
+        process(wc);
+    }
+
+    return m_num_processed;
+}
+
+void RdmaRpcServer::serve_one()
+{
+    rethrow_worker_error();
+    m_num_processed = 0;
+
+    while(m_num_processed == 0)
+    {
+        process(m_conn.wait_event());
+    }
+}
+
+void RdmaRpcServer::start_workers(size_t num_workers)
+{
+    if(!m_workers.empty())
+    {
+        THROW_ERROR("start_workers(): the workers are already running");
+    }
+
+    if(num_workers == 0)
+    {
+        THROW_ERROR("start_workers(): at least one worker is needed");
+    }
+
+    m_requests.reset(new RdmaMpmcQueue<PendingRequest>(m_num_slots));
+    m_free_responses.reset(new RdmaMpmcQueue<uint32_t>(m_num_slots));
+
+    m_request_signal.count = 0;
+    m_response_signal.count = 0;
+
+    // The workers take the send slots from the queue from now on
+    for(uint32_t slot : m_free_send_slots)
+    {
+        m_free_responses->try_push(slot);
+        notify(m_response_signal);
+    }
+    m_free_send_slots.clear();
+
+    m_stopping = false;
+    m_aborting = false;
+    m_running_workers = num_workers;
+
+    for(size_t i = 0; i < num_workers; i++)
+    {
+        m_workers.emplace_back(&RdmaRpcServer::worker_loop, this);
+    }
+}
+
+void RdmaRpcServer::stop_workers()
+{
+    if(m_workers.empty())
+    {
+        return;
+    }
+
+    m_stopping = true;
+    wake_all();
+
+    // The workers may be waiting for a send slot, which is freed by a send completion
+    ibv_wc wc{};
+    while(m_running_workers > 0)
+    {
+        if(m_conn.poll_event(wc))
+        {
+            process(wc);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    for(std::thread& worker : m_workers)
+    {
+        worker.join();
+    }
+    m_workers.clear();
+
+    uint32_t slot;
+    while(m_free_responses->try_pop(slot))
+    {
+        m_free_send_slots.push_back(slot);
+    }
+
+    // A request pushed after the last worker saw an empty queue, it is processed inline
+    PendingRequest request{};
+    while(m_requests->try_pop(request))
+    {
+        handle_request(request.slot, request.byte_len, acquire_send_slot());
+    }
+
+    rethrow_worker_error();
+}
+
+void RdmaRpcServer::process(const ibv_wc& wc)
+{
+    if(m_workers.empty())
+    {
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+    else if(wc.opcode & IBV_WC_RECV)
+    {
+        // There is at most one request per receiving slot, a full queue is a bug
+        if(!m_requests->try_push(PendingRequest{static_cast<uint32_t>(wc.wr_id), wc.byte_len}))
+        {
+            THROW_ERROR("RPC request queue is full");
+        }
+
+        notify(m_request_signal);
+        m_num_processed++;
+    }
+    else if(wc.opcode == IBV_WC_SEND)
+    {
+        if(!m_free_responses->try_push(static_cast<uint32_t>(wc.wr_id)))
+        {
+            THROW_ERROR("RPC send slot queue is full");
+        }
+
+        notify(m_response_signal);
+    }
+    else
+    {
+        THROW_ERROR("Unexpected completion opcode %d in RPC connection", static_cast<int>(wc.opcode));
+    }
+}
+
+void RdmaRpcServer::notify(Signal& signal)
+{
+    signal.count++;
+
+    // Paired with `wait()`: either the worker sees the count, or we see it sleeping
+    if(signal.sleepers > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_wake_mutex);
+        signal.cv.notify_one();
+    }
+}
+
+void RdmaRpcServer::wait(Signal& signal, bool until_stopping)
+{
+    const auto ready = [this, &signal, until_stopping] {
+        return signal.count > 0 || m_aborting || (until_stopping && m_stopping);
+    };
+
+    for(int i = 0; i < worker_spin_count; i++)
+    {
+        if(ready())
+        {
+            return;
+        }
+
+        std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(m_wake_mutex);
+    signal.sleepers++;
+    signal.cv.wait(lock, ready);
+    signal.sleepers--;
+}
+
+void RdmaRpcServer::wake_all()
+{
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+    m_request_signal.cv.notify_all();
+    m_response_signal.cv.notify_all();
+}
+
+void RdmaRpcServer::worker_loop()
+{
+    PendingRequest request{};
+    uint32_t response_slot_index = 0;
+
+    try
+    {
+        while(!m_aborting)
+        {
+            if(!m_requests->try_pop(request))
+            {
+                if(m_stopping)
+                {
+                    break;
+                }
+
+                wait(m_request_signal, true);
+                continue;
+            }
+            m_request_signal.count--;
+
+            // Stopping still needs a send slot for the requests already received
+            bool has_slot;
+            while(!(has_slot = m_free_responses->try_pop(response_slot_index)) && !m_aborting)
+            {
+                wait(m_response_signal, false);
+            }
+
+            if(!has_slot)
+            {
+                break;
+            }
+            m_response_signal.count--;
+
+            handle_request(request.slot, request.byte_len, response_slot_index);
+        }
+    }
+    catch(...)
+    {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        if(!m_worker_error)
+        {
+            m_worker_error = std::current_exception();
+        }
+    }
+
+    m_running_workers--;
+}
+
+void RdmaRpcServer::rethrow_worker_error()
+{
+    std::exception_ptr error;
+
+    {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        std::swap(error, m_worker_error);
+    }
+
+    if(error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void RdmaRpcServer::on_recv(uint32_t slot, uint32_t byte_len)
+{
+    handle_request(slot, byte_len, acquire_send_slot());
+    m_num_processed++;
+}
+
+void RdmaRpcServer::handle_request(uint32_t slot, uint32_t byte_len, uint32_t response_slot_index)
+{
+    const Buffer request_slot = recv_slot(slot);
+    const auto* request = reinterpret_cast<const RpcHeader*>(request_slot.data);
+
+    const Buffer response_slot = send_slot(response_slot_index);
+    auto* response = reinterpret_cast<RpcHeader*>(response_slot.data);
+
+    response->request_id = request->request_id;
+    response->method = request->method;
+    response->status = RPC_OK;
+    response->size = 0;
+    response->reserved = 0;
+
+    const auto method = m_handlers.find(request->method);
+
+    if(byte_len < sizeof(RpcHeader) || request->size > byte_len - sizeof(RpcHeader))
+    {
+        response->status = RPC_BAD_REQUEST;
+    }
+    else if(method == m_handlers.end())
+    {
+        spdlog::warn("RPC request for unknown method {}", request->method);
+        response->status = RPC_UNKNOWN_METHOD;
+    }
+    else if(request->size < method->second.min_request_size)
+    {
+        spdlog::warn("RPC request of {} bytes is too small for method {}", request->size, request->method);
+        response->status = RPC_BAD_REQUEST;
+    }
+    else
+    {
+        RdmaTracer* const tracer = m_conn.get_tracer();
+        const uint64_t handler_begin_ns = tracer ? RdmaTracer::now() : 0;
+
+        // A failed request still reposts its slot and gets a response, so the client does not wait forever
+        try
+        {
+            response->size = method->second.handler(payload(request_slot, request->size),
+                                                     payload(response_slot, max_payload_size()));
+
+            if(response->size > max_payload_size())
+            {
+                spdlog::error("RPC handler of method {} returned a too large response of {} bytes",
+                              request->method, response->size);
+                response->status = RPC_HANDLER_ERROR;
+                response->size = 0;
+            }
+        }
+        catch(const std::exception& e)
+        {
+            spdlog::error("RPC handler of method {} failed: {}", request->method, e.what());
+            response->status = RPC_HANDLER_ERROR;
+            response->size = 0;
+        }
+        catch(...)
+        {
+            spdlog::error("RPC handler of method {} failed", request->method);
+            response->status = RPC_HANDLER_ERROR;
+            response->size = 0;
+        }
+
+        if(tracer)
+        {
+            tracer->on_handler(slot, handler_begin_ns, RdmaTracer::now());
+        }
+    }
+
+    // The handler does not read the request anymore, the slot can receive the next one.
+    // This is done before sending the response, so the client can not send a request before it is posted.
+    std::lock_guard<std::mutex> lock(m_post_mutex);
+    post_recv_slot(slot);
+    post_send_slot(response_slot_index);
+}
+
+RdmaRpcClient::RdmaRpcClient(RdmaBase& conn, uint32_t num_slots)
+    : RdmaRpcSlots(conn, num_slots)
+{
+    for(uint32_t i = 0; i < num_slots; i++)
+    {
+        post_recv_slot(i);
+    }
+}
+
+uint32_t RdmaRpcClient::reserve()
+{
+    // Each request in flight takes a receiving slot in the server until its response is sent
+    while(m_pending.size() >= m_num_slots)
+    {
+        const ibv_wc wc = m_conn.wait_event();
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+
+    return acquire_send_slot();
+}
+
+uint32_t RdmaRpcClient::post_request(uint32_t slot, uint16_t method, uint32_t size, ResponseHandler on_response)
+{
+    if(size > max_payload_size())
+    {
+        m_free_send_slots.push_back(slot);
+        THROW_ERROR("RPC request of %u bytes does not fit in a slot", size);
+    }
+
+    auto* header = reinterpret_cast<RpcHeader*>(send_slot(slot).data);
+    header->request_id = m_next_request_id++;
+    header->method = method;
+    header->status = RPC_OK;
+    header->size = size;
+    header->reserved = 0;
+
+    m_pending.emplace(header->request_id, std::move(on_response));
+    post_send_slot(slot);
+
+    return header->request_id;
+}
+
+int RdmaRpcClient::poll()
+{
+    m_num_processed = 0;
+
+    ibv_wc wc{};
+    while(m_conn.poll_event(wc))
+    {
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+
+    return m_num_processed;
+}
+
+void RdmaRpcClient::wait(uint32_t request_id)
+{
+    while(m_pending.count(request_id) != 0)
+    {
+        const ibv_wc wc = m_conn.wait_event();
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+}
+
+void RdmaRpcClient::wait_all()
+{
+    while(!m_pending.empty())
+    {
+        const ibv_wc wc = m_conn.wait_event();
+        process_completion(wc, [this](uint32_t slot, uint32_t byte_len) {
+            on_recv(slot, byte_len);
+        });
+    }
+}
+
+void RdmaRpcClient::on_recv(uint32_t slot, uint32_t byte_len)
+{
+    const Buffer response_slot = recv_slot(slot);
+    const auto* response = reinterpret_cast<const RpcHeader*>(response_slot.data);
+
+    if(byte_len < sizeof(RpcHeader) || response->size > byte_len - sizeof(RpcHeader))
+    {
+        THROW_ERROR("Malformed RPC response of %u bytes", byte_len);
+    }
+
+    const auto pending = m_pending.find(response->request_id);
+    if(pending == m_pending.end())
+    {
+        THROW_ERROR("RPC response for unknown request %u", response->request_id);
+    }
+
+    // Remove it first, so the handler can send new requests
+    const ResponseHandler on_response = std::move(pending->second);
+    m_pending.erase(pending);
+
+    try
+    {
+        on_response(response->status, payload(response_slot, response->size));
+    }
+    catch(...)
+    {
+        // The slot must not be lost if the handler throws
+        post_recv_slot(slot);
+        throw;
+    }
+
+    post_recv_slot(slot);
+    m_num_processed++;
+}
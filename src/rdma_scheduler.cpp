@@ -0,0 +1,204 @@
+#include "rdma_scheduler.h"
+#include <algorithm>
+
+RdmaSendScheduler::RdmaSendScheduler(uint32_t chunk_size, uint32_t max_bulk_in_flight)
+    : m_chunk_size(chunk_size),
+      m_max_bulk_in_flight(max_bulk_in_flight)
+{
+    if(chunk_size == 0 || max_bulk_in_flight == 0)
+    {
+        THROW_ERROR("RdmaSendScheduler: the chunk size and the number of chunks in flight should not be 0");
+    }
+}
+
+size_t RdmaSendScheduler::add_peer(RdmaBase& conn, size_t control_qp, size_t bulk_qp, uint32_t weight)
+{
+    if(control_qp == bulk_qp || control_qp >= conn.num_qps() || bulk_qp >= conn.num_qps())
+    {
+        THROW_ERROR("add_peer(): the control QP %zu and the bulk QP %zu should be different QPs of the connection",
+                    control_qp, bulk_qp);
+    }
+
+    if(weight == 0)
+    {
+        THROW_ERROR("add_peer(): the weight should not be 0");
+    }
+
+    // No weight can make the quantum wrap to 0, which would never let the peer post
+    static_assert(sizeof(Peer::quantum) >= sizeof(m_chunk_size) + sizeof(weight),
+                  "The quantum should hold the product of the chunk size and the weight");
+
+    // The completions of a connection are polled once per `progress()`
+    for(const Peer& peer : m_peers)
+    {
+        if(peer.conn == &conn)
+        {
+            THROW_ERROR("add_peer(): the connection is already a peer");
+        }
+    }
+
+    // Each peer can have all the bulk chunks in flight
+    if(m_max_bulk_in_flight > conn.get_options().max_send_wr)
+    {
+        THROW_ERROR("add_peer(): %u chunks in flight do not fit in the send queue", m_max_bulk_in_flight);
+    }
+
+    Peer peer;
+    peer.conn = &conn;
+    peer.control_qp = control_qp;
+    peer.bulk_qp = bulk_qp;
+    peer.quantum = static_cast<uint64_t>(m_chunk_size) * weight;
+    m_peers.push_back(std::move(peer));
+
+    return m_peers.size() - 1;
+}
+
+void RdmaSendScheduler::send_control(size_t peer, const Buffer& buf, uint64_t wr_id)
+{
+    Peer& p = m_peers.at(peer);
+    p.conn->post_send(buf, wr_id, true, p.control_qp);
+}
+
+uint64_t RdmaSendScheduler::write_bulk(size_t peer, const Buffer& local, uint64_t remote_addr, uint32_t rkey)
+{
+    Peer& p = m_peers.at(peer);
+    const uint64_t transfer_id = m_next_transfer_id++;
+
+    if(local.size == 0)
+    {
+        return transfer_id;
+    }
+
+    m_transfers.emplace(transfer_id, Transfer{});
+
+    if(p.pending.empty())
+    {
+        m_active.push_back(peer);
+    }
+    p.pending.push_back({transfer_id, local, remote_addr, rkey});
+
+    schedule();
+    return transfer_id;
+}
+
+int RdmaSendScheduler::progress()
+{
+    int num_done = 0;
+
+    for(size_t i = 0; i < m_peers.size(); i++)
+    {
+        ibv_wc wc{};
+        while(m_peers[i].conn->poll_event(wc))
+        {
+            if(process_completion(i, wc))
+            {
+                num_done++;
+            }
+        }
+    }
+
+    schedule();
+    return num_done;
+}
+
+void RdmaSendScheduler::wait(uint64_t transfer_id)
+{
+    while(!is_done(transfer_id))
+    {
+        progress();
+    }
+}
+
+void RdmaSendScheduler::wait_all()
+{
+    while(!m_transfers.empty())
+    {
+        progress();
+    }
+}
+
+void RdmaSendScheduler::schedule()
+{
+    while(m_bulk_in_flight < m_max_bulk_in_flight && !m_active.empty())
+    {
+        Peer& peer = m_peers[m_active.front()];
+
+        if(!m_front_credited)
+        {
+            peer.deficit += peer.quantum;
+            m_front_credited = true;
+        }
+
+        PendingWrite& write = peer.pending.front();
+        const uint32_t size = std::min(write.local.size, m_chunk_size);
+
+        if(peer.deficit < size)
+        {
+            // End of its round, serve the next peer
+            m_active.push_back(m_active.front());
+            m_active.pop_front();
+            m_front_credited = false;
+            continue;
+        }
+
+        peer.conn->post_write(Buffer{write.local.data, size}, write.remote_addr, write.rkey, true, peer.bulk_qp);
+
+        peer.deficit -= size;
+        peer.posted.push_back(write.transfer_id);
+        m_transfers[write.transfer_id].chunks_in_flight++;
+        m_bulk_in_flight++;
+
+        write.local.data += size;
+        write.local.size -= size;
+        write.remote_addr += size;
+
+        if(write.local.size == 0)
+        {
+            m_transfers[write.transfer_id].fully_posted = true;
+            peer.pending.pop_front();
+        }
+
+        // A peer does not keep its deficit while it has nothing to send
+        if(peer.pending.empty())
+        {
+            peer.deficit = 0;
+            m_active.pop_front();
+            m_front_credited = false;
+        }
+    }
+}
+
+bool RdmaSendScheduler::process_completion(size_t peer_index, const ibv_wc& wc)
+{
+    Peer& peer = m_peers[peer_index];
+
+    // Writes posted on the other QPs of the connection are not bulk chunks
+    if(wc.opcode != IBV_WC_RDMA_WRITE || wc.qp_num != peer.conn->get_qp_num(peer.bulk_qp))
+    {
+        if(m_on_completion)
+        {
+            m_on_completion(peer_index, wc);
+        }
+        return false;
+    }
+
+    if(peer.posted.empty())
+    {
+        THROW_ERROR("Write completion of peer %zu without a bulk chunk in flight", peer_index);
+    }
+
+    const uint64_t transfer_id = peer.posted.front();
+    peer.posted.pop_front();
+    m_bulk_in_flight--;
+
+    const auto transfer = m_transfers.find(transfer_id);
+    transfer->second.chunks_in_flight--;
+
+    if(transfer->second.fully_posted && transfer->second.chunks_in_flight == 0)
+    {
+        m_transfers.erase(transfer);
+        return true;
+    }
+
+    return false;
+}
@@ -1,9 +1,12 @@
 #include "rdma_server.h"
 #include "rdma_client.h"
 #include "spdlog/spdlog.h"
+#include <arpa/inet.h>
+#include <algorithm>
 
-RdmaServer::RdmaServer(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port)
-        : RdmaBase(send_buf_sz, recv_buf_sz)
+RdmaServer::RdmaServer(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::string& server_addr, int server_port,
+                       const RdmaOptions& options)
+        : RdmaBase(send_buf_sz, recv_buf_sz, options)
 {
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
@@ -14,8 +17,21 @@ RdmaServer::RdmaServer(uint32_t send_buf_sz, uint32_t recv_buf_sz, const std::st
     spdlog::info("Created RDMA server to listen on address {}:{}", server_addr, server_port);
     spdlog::info("Created RDMA server buffer sizes: send={}, recv={}", send_buf_sz, recv_buf_sz);
 
-    HENSURE_ERRNO(rdma_bind_addr(m_connection_id, reinterpret_cast<sockaddr*>(&addr)) == 0);
-    HENSURE_ERRNO(rdma_listen(m_connection_id, backlog) == 0);
+    // An empty address listens on all the devices
+    if(!server_addr.empty())
+    {
+        HTHROW_ERRNO(inet_aton(server_addr.c_str(), &addr.sin_addr) != 0);
+    }
+
+    HTHROW_ERRNO(rdma_bind_addr(m_connection_id, reinterpret_cast<sockaddr*>(&addr)) == 0);
+    HTHROW_ERRNO(rdma_listen(m_connection_id, backlog) == 0);
+
+    // Bound to the address of a device: the context can be created now,
+    // so memory can be registered before the client connects
+    if(m_connection_id->verbs)
+    {
+        setup_context(m_connection_id->verbs);
+    }
 }
 
 RdmaServer::~RdmaServer()
@@ -39,7 +55,7 @@ bool RdmaServer::on_event_received(rdma_cm_event* const event)
             return false; // Breaks the event loop
         
         default:
-            FATAL_ERROR("on_event_received(): Unknown RDMA event: %d", (int)event->event);
+            THROW_ERROR("on_event_received(): Unknown RDMA event: %d", (int)event->event);
             break;
     }
 
@@ -50,22 +66,54 @@ void RdmaServer::on_conn_request(rdma_cm_id* const id)
 {
     spdlog::info("Received RDMA connection request");
 
+    // Which QP of the connection is requested, clients without private data open a single QP
+    ConnectInfo info{0, 1};
+    if(m_event_private_data.size() >= sizeof(info))
+    {
+        std::memcpy(&info, m_event_private_data.data(), sizeof(info));
+    }
+
+    if(m_qps.empty())
+    {
+        m_qps.resize(std::max<uint16_t>(info.num_qps, 1));
+    }
+
+    if(info.qp_index >= m_qps.size() || m_qps[info.qp_index].id)
+    {
+        rdma_reject(id, nullptr, 0);
+        rdma_destroy_id(id);
+        THROW_ERROR("Unexpected connection request for QP %u/%u", info.qp_index, info.num_qps);
+    }
+
     setup_context(id->verbs);
     
     ibv_qp_init_attr attr{};
     build_qp_init_attr(m_cq, &attr);
-    HENSURE_ERRNO(rdma_create_qp(id, m_pd, &attr) == 0);
+    HTHROW_ERRNO(rdma_create_qp(id, m_pd, &attr) == 0);
     
     // The ID that will be use for send/recv
-    m_qp = id->qp;
-    m_qp_id = id;
+    m_qps[info.qp_index].id = id;
+    m_qps[info.qp_index].qp = id->qp;
 
     // Pre-post receive event on the to be sure there is one receive work
     // before the remote sends a message
-    post_receive();
+    if(m_options.prepost_receive)
+    {
+        post_receive(info.qp_index);
+    }
+
+    setup_id(id);
 
     rdma_conn_param param{};
-    HENSURE_ERRNO(rdma_accept(id, &param) == 0);
+    build_conn_param(&param, &m_event_conn_param);
+
+    if(!m_private_data.empty())
+    {
+        param.private_data = m_private_data.data();
+        param.private_data_len = static_cast<uint8_t>(m_private_data.size());
+    }
+
+    HTHROW_ERRNO(rdma_accept(id, &param) == 0);
 }
 
 void RdmaServer::on_conn_established(void* user_context)
@@ -78,15 +126,16 @@ void RdmaServer::on_disconnect(rdma_cm_id* const id)
     spdlog::info("RDMA connection disconnected");
     
     rdma_destroy_qp(id);
-    HENSURE_ERRNO(rdma_destroy_id(id) == 0);
+    HTHROW_ERRNO(rdma_destroy_id(id) == 0);
 }
 
 void RdmaServer::wait_until_connected()
 {
     spdlog::info("Waiting incoming RDMA connection...");
 
-    bool stop = false;
-    while(!stop)
+    // The number of QPs is known with the first connection request
+    size_t num_established = 0;
+    while(m_qps.empty() || num_established < m_qps.size())
     {
         const rdma_cm_event event = wait_cm_event();
 
@@ -97,14 +146,61 @@ void RdmaServer::wait_until_connected()
                 break;
 
             case RDMA_CM_EVENT_ESTABLISHED:
-                stop = true;
+                on_qp_established(find_qp(event.id));
+                num_established++;
                 break;
 
-            default:
-                FATAL_ERROR("Unknown RDMA event: %d", static_cast<int>(event.event));
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+            case RDMA_CM_EVENT_UNREACHABLE:
+                THROW_ERROR("Incoming connection failed: %s (status %d)", rdma_event_str(event.event), event.status);
+
+            case RDMA_CM_EVENT_DISCONNECTED:
+            case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+                // Left over from a previous connection
+                spdlog::warn("Ignored RDMA event while connecting: {}", rdma_event_str(event.event));
                 break;
+
+            default:
+                THROW_ERROR("Unknown RDMA event: %d", static_cast<int>(event.event));
         }
     }
 
-    spdlog::info("RDMA connection established");
+    spdlog::info("RDMA connection established with {} QP(s)", m_qps.size());
+}
+
+void RdmaServer::set_private_data(const void* data, size_t size)
+{
+    // Maximum private data of a connection reply
+    const size_t max_size = 196;
+
+    if(size > max_size)
+    {
+        THROW_ERROR("Private data of %zu bytes exceeds the maximum of %zu bytes", size, max_size);
+    }
+
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    m_private_data.assign(bytes, bytes + size);
+}
+
+size_t RdmaServer::find_qp(rdma_cm_id* const id) const
+{
+    for(size_t i = 0; i < m_qps.size(); i++)
+    {
+        if(m_qps[i].id == id)
+        {
+            return i;
+        }
+    }
+
+    THROW_ERROR("Unknown RDMA connection ID");
+}
+
+void RdmaServer::reconnect()
+{
+    spdlog::info("Waiting the RDMA client to reconnect");
+
+    // The listening ID is kept, only the connected ones are destroyed
+    destroy_qp();
+
+    wait_until_connected();
 }
@@ -0,0 +1,244 @@
+#include "rdma_trace.h"
+#include "helper_errno.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <set>
+
+namespace
+{
+
+const char* opcode_name(uint16_t opcode)
+{
+    switch(opcode)
+    {
+        case IBV_WC_SEND: return "SEND";
+        case IBV_WC_RDMA_WRITE: return "RDMA_WRITE";
+        case IBV_WC_RDMA_READ: return "RDMA_READ";
+        case IBV_WC_COMP_SWAP: return "COMP_SWAP";
+        case IBV_WC_FETCH_ADD: return "FETCH_ADD";
+        case IBV_WC_BIND_MW: return "BIND_MW";
+        case IBV_WC_LOCAL_INV: return "LOCAL_INV";
+        case IBV_WC_RECV: return "RECV";
+        case IBV_WC_RECV_RDMA_WITH_IMM: return "RECV_RDMA_WITH_IMM";
+        default: return "UNKNOWN";
+    }
+}
+
+// Small index of the calling thread, stable for its lifetime
+uint32_t thread_index()
+{
+    static std::atomic<uint32_t> next_index{0};
+    thread_local const uint32_t index = next_index++;
+    return index;
+}
+
+// Chrome trace times are in microseconds
+double to_us(uint64_t ns, uint64_t origin_ns)
+{
+    return static_cast<double>(ns - origin_ns) / 1e3;
+}
+
+}
+
+RdmaTracer::RdmaTracer(size_t capacity)
+    : m_events(capacity)
+{
+    if(capacity == 0)
+    {
+        THROW_ERROR("RdmaTracer: the capacity should not be 0");
+    }
+}
+
+uint64_t RdmaTracer::now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void RdmaTracer::on_post(uint32_t qp_num, uint64_t wr_id, bool recv)
+{
+    const uint64_t post_ns = now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Operations that never complete (flushed by a reconnection) would pile up
+    if(m_num_posted >= m_events.size())
+    {
+        m_posted.clear();
+        m_num_posted = 0;
+    }
+
+    PostedOps& ops = m_posted[qp_num];
+    std::unordered_map<uint64_t, uint64_t>& posted = recv ? ops.recvs : ops.sends;
+
+    if(posted.insert_or_assign(wr_id, post_ns).second)
+    {
+        m_num_posted++;
+    }
+}
+
+void RdmaTracer::on_completion(const ibv_wc& wc, uint64_t completion_ns, bool hw_timestamp, uint64_t poll_ns)
+{
+    RdmaTraceEvent event{};
+    event.kind = RdmaTraceEvent::Kind::Operation;
+    event.hw_timestamp = hw_timestamp;
+    event.opcode = static_cast<uint16_t>(wc.opcode);
+    event.track = wc.qp_num;
+    event.byte_len = wc.byte_len;
+    event.wr_id = wc.wr_id;
+    event.end_ns = completion_ns;
+    event.poll_ns = poll_ns;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    const auto qp = m_posted.find(wc.qp_num);
+    if(qp != m_posted.end())
+    {
+        std::unordered_map<uint64_t, uint64_t>& ops = (wc.opcode & IBV_WC_RECV) ? qp->second.recvs : qp->second.sends;
+
+        const auto posted = ops.find(wc.wr_id);
+        if(posted != ops.end())
+        {
+            event.begin_ns = posted->second;
+            ops.erase(posted);
+            m_num_posted--;
+        }
+    }
+
+    push(event);
+}
+
+void RdmaTracer::on_handler(uint64_t wr_id, uint64_t begin_ns, uint64_t end_ns)
+{
+    RdmaTraceEvent event{};
+    event.kind = RdmaTraceEvent::Kind::Handler;
+    event.track = thread_index();
+    event.wr_id = wr_id;
+    event.begin_ns = begin_ns;
+    event.end_ns = end_ns;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    push(event);
+}
+
+void RdmaTracer::push(const RdmaTraceEvent& event)
+{
+    m_events[m_next] = event;
+
+    if(++m_next == m_events.size())
+    {
+        m_next = 0;
+        m_full = true;
+    }
+}
+
+std::vector<RdmaTraceEvent> RdmaTracer::events() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if(!m_full)
+    {
+        return std::vector<RdmaTraceEvent>(m_events.begin(), m_events.begin() + static_cast<ptrdiff_t>(m_next));
+    }
+
+    std::vector<RdmaTraceEvent> ordered(m_events.begin() + static_cast<ptrdiff_t>(m_next), m_events.end());
+    ordered.insert(ordered.end(), m_events.begin(), m_events.begin() + static_cast<ptrdiff_t>(m_next));
+    return ordered;
+}
+
+void RdmaTracer::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_next = 0;
+    m_full = false;
+    m_posted.clear();
+    m_num_posted = 0;
+}
+
+void RdmaTracer::dump_chrome_trace(std::ostream& out) const
+{
+    // Operations and handlers are two processes of the trace, with a track per QP and per thread
+    const int operations_pid = 1;
+    const int handlers_pid = 2;
+
+    const std::vector<RdmaTraceEvent> all_events = events();
+
+    uint64_t origin_ns = UINT64_MAX;
+    std::set<std::pair<int, uint32_t>> tracks;
+
+    for(const RdmaTraceEvent& event : all_events)
+    {
+        origin_ns = std::min(origin_ns, event.begin_ns != 0 ? event.begin_ns : event.end_ns);
+        tracks.emplace(event.kind == RdmaTraceEvent::Kind::Operation ? operations_pid : handlers_pid, event.track);
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << operations_pid
+        << ",\"args\":{\"name\":\"RDMA operations\"}},\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << handlers_pid
+        << ",\"args\":{\"name\":\"Handlers\"}}";
+
+    for(const auto& track : tracks)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << track.first << ",\"tid\":" << track.second
+            << ",\"args\":{\"name\":\"" << (track.first == operations_pid ? "QP " : "Thread ") << track.second
+            << "\"}}";
+    }
+
+    for(const RdmaTraceEvent& event : all_events)
+    {
+        out << ",\n";
+
+        if(event.kind == RdmaTraceEvent::Kind::Handler)
+        {
+            out << "{\"name\":\"handler\",\"cat\":\"handler\",\"ph\":\"X\",\"pid\":" << handlers_pid
+                << ",\"tid\":" << event.track
+                << ",\"ts\":" << to_us(event.begin_ns, origin_ns)
+                << ",\"dur\":" << to_us(event.end_ns, event.begin_ns)
+                << ",\"args\":{\"wr_id\":" << event.wr_id << "}}";
+            continue;
+        }
+
+        out << "{\"name\":\"" << opcode_name(event.opcode) << "\",\"cat\":\"rdma\",\"pid\":" << operations_pid
+            << ",\"tid\":" << event.track;
+
+        if(event.begin_ns != 0 && event.begin_ns <= event.end_ns)
+        {
+            out << ",\"ph\":\"X\",\"ts\":" << to_us(event.begin_ns, origin_ns)
+                << ",\"dur\":" << to_us(event.end_ns, event.begin_ns);
+        }
+        else
+        {
+            // The post was not traced, only the completion is known
+            out << ",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << to_us(event.end_ns, origin_ns);
+        }
+
+        out << ",\"args\":{\"wr_id\":" << event.wr_id
+            << ",\"bytes\":" << event.byte_len
+            << ",\"hw_timestamp\":" << (event.hw_timestamp ? "true" : "false")
+            << ",\"poll_delay_us\":" << (event.poll_ns >= event.end_ns ? to_us(event.poll_ns, event.end_ns) : 0.0)
+            << "}}";
+    }
+
+    out << "\n]}\n";
+}
+
+void RdmaTracer::dump_chrome_trace(const std::string& path) const
+{
+    std::ofstream out(path);
+    if(!out)
+    {
+        THROW_ERROR("dump_chrome_trace(): can not open %s", path.c_str());
+    }
+
+    dump_chrome_trace(out);
+
+    if(!out)
+    {
+        THROW_ERROR("dump_chrome_trace(): failed to write %s", path.c_str());
+    }
+}
@@ -0,0 +1,85 @@
+#include "rdma_window.h"
+#include <algorithm>
+
+RdmaWindowPool::RdmaWindowPool(RdmaBase& conn, size_t num_windows)
+    : m_conn(conn)
+{
+    try
+    {
+        for(size_t i = 0; i < num_windows; i++)
+        {
+            m_windows.push_back(m_conn.alloc_window());
+        }
+    }
+    catch(...)
+    {
+        for(ibv_mw* mw : m_windows)
+        {
+            m_conn.dealloc_window(mw);
+        }
+        throw;
+    }
+
+    for(ibv_mw* mw : m_windows)
+    {
+        m_free.push_back({mw, unbound});
+    }
+}
+
+RdmaWindowPool::~RdmaWindowPool()
+{
+    for(ibv_mw* mw : m_windows)
+    {
+        HENSURE_ERRNO(ibv_dealloc_mw(mw) == 0);
+    }
+}
+
+RdmaGrant RdmaWindowPool::grant(const Buffer& buf, int access, size_t qp_index)
+{
+    // Prefer a window already used on this QP, to keep the unbound ones for the other QPs
+    auto it = std::find_if(m_free.begin(), m_free.end(), [qp_index](const FreeWindow& w) {
+        return w.qp_index == qp_index;
+    });
+
+    if(it == m_free.end())
+    {
+        it = std::find_if(m_free.begin(), m_free.end(), [](const FreeWindow& w) {
+            return w.qp_index == unbound;
+        });
+    }
+
+    if(it == m_free.end())
+    {
+        THROW_ERROR("grant(): no memory window free for QP %zu (%zu windows)", qp_index, m_windows.size());
+    }
+
+    ibv_mw* const mw = it->mw;
+    const uint32_t rkey = m_conn.post_bind_window(mw, buf, access, false, qp_index);
+    m_free.erase(it);
+
+    return {reinterpret_cast<uint64_t>(buf.data), rkey, buf.size, mw, qp_index};
+}
+
+void RdmaWindowPool::revoke(const RdmaGrant& grant)
+{
+    if(std::find(m_windows.begin(), m_windows.end(), grant.mw) == m_windows.end())
+    {
+        THROW_ERROR("revoke(): the grant is not from this pool");
+    }
+
+    if(std::any_of(m_free.begin(), m_free.end(), [&grant](const FreeWindow& w) { return w.mw == grant.mw; }))
+    {
+        THROW_ERROR("revoke(): the grant is already revoked");
+    }
+
+    // The next bind of this window is posted after the invalidation on the same QP, so it can be reused at once
+    m_conn.post_invalidate(grant.rkey, false, grant.qp_index);
+    m_free.push_back({grant.mw, grant.qp_index});
+}
+
+size_t RdmaWindowPool::available(size_t qp_index) const
+{
+    return static_cast<size_t>(std::count_if(m_free.begin(), m_free.end(), [qp_index](const FreeWindow& w) {
+        return w.qp_index == qp_index || w.qp_index == unbound;
+    }));
+}